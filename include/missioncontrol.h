@@ -13,7 +13,29 @@
 #include <poll.h>
 #include <vector>
 #include <functional>
+#include <optional>
+#include <concepts>
+#include <cstdint>
+#include <cstddef>
+#include <bit>
+#include <type_traits>
+#include <charconv>
+#include <string_view>
+#include <algorithm>
+#include <array>
+#include <tuple>
+#include <utility>
+#include <cmath>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
+#include <new>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <net.hpp>
+#include <recording.hpp>
 
 /**
  * @brief The serialize namespace contains all the serialize() methods in order to serialize readable objects.
@@ -21,6 +43,60 @@
  * 
  */
 namespace serialize {
+    /**
+     * @brief Append the json for a value to out. Numbers are written with std::to_chars, so nothing is allocated
+     * once out has grown big enough. Types without an append() overload fall back to serialize().
+     * 
+     * @param out 
+     * @param d 
+     */
+    void append(std::string& out, const double& d);
+    void append(std::string& out, const int& d);
+    void append(std::string& out, const long& d);
+    void append(std::string& out, const std::string& d);
+    void append(std::string& out, std::string_view d);
+
+    template <typename T>
+    void append(std::string& out, const std::vector<T>& s);
+
+    template <typename T>
+    void append(std::string& out, const T& t);
+
+    /**
+     * @brief The fields of a struct, described once with MISSION_CONTROL_FIELDS(). Specialized by the macro.
+     * 
+     * @tparam T 
+     */
+    template<typename T>
+    struct fields;
+
+    /**
+     * @brief One described field: its json key and a pointer to the member.
+     * 
+     * @tparam T 
+     * @tparam M 
+     */
+    template<typename T, typename M>
+    struct field {
+        typedef M type;
+        std::string_view key; // "name":
+        M T::* member;
+
+        constexpr std::string_view name() const { return key.substr(1, key.size() - 3); }
+    };
+
+    template<typename T>
+    concept described = requires { fields<T>::members; };
+
+    /**
+     * @brief Append a described struct as {"field":value,...}, writing every field straight into out.
+     * 
+     * @param out 
+     * @param t 
+     */
+    template<described T>
+    void append(std::string& out, const T& t);
+
     std::string serialize(const double& d);
 
     std::string serialize(const int& d);
@@ -33,6 +109,17 @@ namespace serialize {
     std::string serialize(const T& t) {
         return t.serialize();
     }
+    template<described T>
+    std::string serialize(const T& t) {
+        std::string out;
+        append(out, t);
+        return out;
+    }
+    /**
+     * @brief Parse a value sent with set. Described structs are read from {"field":value,...}; fields that are
+     * left out keep their default value, and unknown fields throw.
+     * 
+     */
     template<typename T>
     T deserialize(const std::string& s);
 
@@ -53,9 +140,104 @@ namespace serialize {
     template<>
     std::vector<std::string> deserialize<std::vector<std::string>>(const std::string& s);
 
+    /**
+     * @brief Binary wire format. Values are written little-endian, and each readable is advertised with a type tag
+     * so clients know how to read it. Types without a binary writer are sent as length prefixed json.
+     * 
+     */
+    namespace binary {
+        enum tag : uint8_t {
+            json = 'j', // u32 length, json text
+            f64 = 'd',
+            i32 = 'i',
+            string = 's', // u32 length, bytes
+            f64_array = 'D', // u32 count, f64s
+            i32_array = 'I', // u32 count, i32s
+            samples = 'c', // u32 count, u8 tag of the values, count i64 times (us), count values
+            object = 'o' // u8 n_fields, then for each: u8 name length, name, u8 tag, value
+        };
 
+        template<typename T> constexpr tag tag_of = json;
+        template<described T> inline constexpr tag tag_of<T> = object;
+        template<> inline constexpr tag tag_of<double> = f64;
+        template<> inline constexpr tag tag_of<int> = i32;
+        template<> inline constexpr tag tag_of<std::string> = string;
+        template<> inline constexpr tag tag_of<std::vector<double>> = f64_array;
+        template<> inline constexpr tag tag_of<std::vector<int>> = i32_array;
+
+        /**
+         * @brief Append a number little-endian.
+         * 
+         * @tparam T 
+         * @param out 
+         * @param value 
+         */
+        template<typename T>
+        void put(std::string& out, T value);
+
+        void write(std::string& out, const double& d);
+        void write(std::string& out, const int& d);
+        void write(std::string& out, const std::string& d);
+        void write(std::string& out, const std::vector<double>& d);
+        void write(std::string& out, const std::vector<int>& d);
+
+        template<typename T>
+        void write(std::string& out, const T& t);
+        template<described T>
+        void write(std::string& out, const T& t);
+
+        /**
+         * @brief Fill in the u32 length at the start of a frame once the rest of it has been written.
+         * 
+         * @param frame 
+         */
+        void finish_frame(std::string& frame);
+
+        /**
+         * @brief Append the json for a value written with the given tag, e.g. one read back from a recording.
+         * 
+         * @param out 
+         * @param tag 
+         * @param bytes The encoded value.
+         * @return Bytes of the value used, 0 if it is malformed.
+         */
+        size_t append_json(std::string& out, uint8_t tag, std::string_view bytes);
+    };
 };
 
+/**
+ * @brief Describe the fields of a struct once, so that it can be bound as a readable or added as a writable without
+ * writing serialize() for it. Use it at global scope (not inside a namespace, since it specializes templates in
+ * serialize), after including missioncontrol.h. Up to 16 fields.
+ * 
+ *      MISSION_CONTROL_FIELDS(math::vector, x, y, z)
+ * 
+ * is sent as {"x":1,"y":2,"z":3} in json, and as a binary::object in binary.
+ */
+#define MISSION_CONTROL_FIELDS(Type, ...) \
+    template<> struct serialize::fields<Type> { \
+        static constexpr auto members = std::make_tuple(MISSION_CONTROL_FIELDS_PICK(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1)(Type, __VA_ARGS__)); \
+    };
+
+#define MISSION_CONTROL_FIELD(Type, name) ::serialize::field<Type, decltype(Type::name)>{ "\"" #name "\":", &Type::name }
+#define MISSION_CONTROL_FIELDS_PICK(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) MISSION_CONTROL_FIELDS_##N
+#define MISSION_CONTROL_FIELDS_1(T, a) MISSION_CONTROL_FIELD(T, a)
+#define MISSION_CONTROL_FIELDS_2(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_1(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_3(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_2(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_4(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_3(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_5(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_4(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_6(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_5(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_7(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_6(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_8(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_7(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_9(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_8(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_10(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_9(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_11(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_10(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_12(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_11(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_13(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_12(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_14(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_13(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_15(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_14(T, __VA_ARGS__)
+#define MISSION_CONTROL_FIELDS_16(T, a, ...) MISSION_CONTROL_FIELD(T, a), MISSION_CONTROL_FIELDS_15(T, __VA_ARGS__)
+
 /**
  * @brief A readable wrapper. Shorthand to name variables easily. Use *readable in order to retrieve a reference to the underlying data.
  * 
@@ -63,8 +245,22 @@ namespace serialize {
  */
 template<typename T>
 struct readable{
-    T data;
+    // Word aligned so store() and load() can copy it a word at a time.
+    alignas(T) alignas(uint64_t) T data;
     std::string name;
+    /**
+     * @brief Incremented by operator= and mark_changed(), but not by store(), which may run on another thread.
+     * mission_control sends a readable when its version moved or its value differs from the one last sent, so
+     * store() and writes through *readable or T& are picked up by comparing.
+     * Types that can't be compared (no operator==, not trivially copyable) are sent every tick.
+     * 
+     */
+    unsigned long version = 0;
+    /**
+     * @brief Seqlock for store() and load(). Odd while a store() is in progress, 0 if store() was never used.
+     * 
+     */
+    std::atomic<unsigned long> sequence = 0;
     /**
      * @brief Construct a new readable object with a name
      * 
@@ -122,6 +318,7 @@ struct readable{
      */
     void operator = (const T& copied) {
         data = copied;
+        version++;
     }
 
     /**
@@ -132,6 +329,665 @@ struct readable{
     T& operator* () {
         return data;
     }
+
+    /**
+     * @brief Mark the readable as changed without writing to it.
+     * 
+     */
+    void mark_changed() {
+        version++;
+    }
+
+    /**
+     * @brief Write the readable from a thread other than the one calling tick(), without tearing.
+     * Wait-free: never blocks on readers. One writer at a time. Only store() counts as a write from the
+     * other thread; don't mix it with operator= or T& there.
+     * 
+     * @param value 
+     */
+    void store(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>, "store() copies T while it may be read, T must be trivially copyable");
+        unsigned long s = sequence.load(std::memory_order_relaxed);
+        sequence.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        const unsigned char * from = reinterpret_cast<const unsigned char *>(&value);
+        unsigned char * to = reinterpret_cast<unsigned char *>(&data);
+        for(size_t i = 0; i < _n_words; i ++) {
+            uint64_t word;
+            memcpy(&word, from + i * sizeof(uint64_t), sizeof(uint64_t));
+            std::atomic_ref<uint64_t>(*reinterpret_cast<uint64_t *>(to + i * sizeof(uint64_t))).store(word, std::memory_order_relaxed);
+        }
+        for(size_t i = _n_words * sizeof(uint64_t); i < sizeof(T); i ++) {
+            std::atomic_ref<unsigned char>(to[i]).store(from[i], std::memory_order_relaxed);
+        }
+        sequence.store(s + 2, std::memory_order_release);
+    }
+
+    /**
+     * @brief Read a consistent copy of the readable while another thread may be in store(). Retries if a
+     * store() happened during the copy.
+     * 
+     * @return T 
+     */
+    T load() const {
+        static_assert(std::is_trivially_copyable_v<T>, "load() copies T while it may be written, T must be trivially copyable");
+        // data is read with relaxed atomics, so racing a store() isn't undefined. A torn copy is thrown away.
+        unsigned char * from = reinterpret_cast<unsigned char *>(const_cast<T *>(&data));
+        alignas(T) unsigned char copy[sizeof(T)];
+        while(true) {
+            unsigned long s = sequence.load(std::memory_order_acquire);
+            if(s & 1) continue;
+            for(size_t i = 0; i < _n_words; i ++) {
+                uint64_t word = std::atomic_ref<uint64_t>(*reinterpret_cast<uint64_t *>(from + i * sizeof(uint64_t))).load(std::memory_order_relaxed);
+                memcpy(copy + i * sizeof(uint64_t), &word, sizeof(uint64_t));
+            }
+            for(size_t i = _n_words * sizeof(uint64_t); i < sizeof(T); i ++) {
+                copy[i] = std::atomic_ref<unsigned char>(from[i]).load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(sequence.load(std::memory_order_relaxed) == s) return std::bit_cast<T>(copy);
+        }
+    }
+
+private:
+    static constexpr size_t _n_words = sizeof(T) / sizeof(uint64_t);
+};
+
+/**
+ * @brief A string usable as a template parameter, for naming channels at compile time.
+ * 
+ * @tparam N 
+ */
+template<size_t N>
+struct fixed_string {
+    char data[N] {};
+
+    constexpr fixed_string(const char (&s)[N]) {
+        std::copy_n(s, N, data);
+    }
+
+    constexpr std::string_view view() const {
+        return std::string_view(data, N - 1);
+    }
+};
+
+/**
+ * @brief One named value in a schema. The json key ("name":) is built at compile time.
+ * 
+ * @tparam Name 
+ * @tparam T 
+ */
+template<fixed_string Name, typename T>
+struct channel {
+    typedef T type;
+    static constexpr std::string_view name = Name.view();
+    static_assert(name.find_first_of("\"\\") == std::string_view::npos, "Channel names can't contain quotes or backslashes");
+
+    static constexpr auto key = [] {
+        std::array<char, name.size() + 3> k {};
+        k[0] = '"';
+        std::copy(name.begin(), name.end(), k.begin() + 1);
+        k[name.size() + 1] = '"';
+        k[name.size() + 2] = ':';
+        return k;
+    }();
+};
+
+/**
+ * @brief A set of channels whose names and types are fixed at compile time. Binding a schema registers
+ * all of its channels at once, and encoding it is a single call that writes every channel inline, rather
+ * than one std::function call per readable. Use get<"name">() to read or write a channel; non-const access
+ * marks the whole schema as changed, like readable<T>.
+ * 
+ *      schema<channel<"roll", double>, channel<"pitch", double>> attitude;
+ *      attitude.get<"roll">() = 0.1;
+ *      control.bind_schema(attitude);
+ * 
+ * @tparam Channels 
+ */
+template<typename... Channels>
+struct schema {
+    // Bound, an empty one would write nothing between the commas around it and break the tick's json.
+    static_assert(sizeof...(Channels) > 0, "A schema needs at least one channel");
+    std::tuple<typename Channels::type...> values;
+    unsigned long version = 0;
+
+    static constexpr size_t size = sizeof...(Channels);
+
+    template<fixed_string Name>
+    static constexpr size_t index_of() {
+        size_t i = 0;
+        size_t found = size;
+        ((Channels::name == Name.view() ? (found = i, i ++) : i ++), ...);
+        return found;
+    }
+
+    template<fixed_string Name>
+    auto& get() {
+        static_assert(index_of<Name>() < size, "No channel with that name");
+        version++;
+        return std::get<index_of<Name>()>(values);
+    }
+
+    template<fixed_string Name>
+    const auto& get() const {
+        static_assert(index_of<Name>() < size, "No channel with that name");
+        return std::get<index_of<Name>()>(values);
+    }
+
+    /**
+     * @brief Append "name":value for every channel, comma seperated.
+     * 
+     * @param out 
+     */
+    void write_json(std::string& out) const {
+        [&]<size_t... I>(std::index_sequence<I...>) {
+            ((I == 0 ? void() : void(out += ','),
+                out.append(Channels::key.data(), Channels::key.size()),
+                serialize::append(out, std::get<I>(values))), ...);
+        }(std::index_sequence_for<Channels...>());
+    }
+
+    /**
+     * @brief Append id, value for every channel. Channel i gets id first_id + i.
+     * 
+     * @param out 
+     * @param first_id 
+     */
+    void write_binary(std::string& out, uint16_t first_id) const {
+        [&]<size_t... I>(std::index_sequence<I...>) {
+            ((serialize::binary::put<uint16_t>(out, first_id + I),
+                serialize::binary::write(out, std::get<I>(values))), ...);
+        }(std::index_sequence_for<Channels...>());
+    }
+};
+
+/**
+ * @brief Records a value at loop rate into a preallocated ring, so that every sample taken between ticks
+ * is sent on the next tick as one block: {"t":[times],"v":[values]} in json, one 'c' value in binary.
+ * record() is wait-free and doesn't allocate (for types that don't allocate when copied). There must be
+ * one thread recording and one thread ticking. When the ring is full, new samples are dropped and counted.
+ * The ring holds the samples of the tick being sent too, so make capacity at least twice the samples per tick.
+ * 
+ * @tparam T 
+ */
+template<typename T>
+struct capture {
+    std::string name;
+    const readable<T> * source = nullptr;
+
+    std::vector<T> values;
+    std::vector<int64_t> times;
+    std::atomic<size_t> head = 0; // Next slot to record into. Written by the recording thread.
+    std::atomic<size_t> tail = 0; // Oldest slot still in use. Written by the ticking thread.
+    std::atomic<size_t> n_dropped = 0;
+
+    // Samples being sent this tick. Only used by the ticking thread.
+    size_t sending_begin = 0;
+    size_t sending_end = 0;
+
+    capture(std::string _name, size_t capacity) : name(_name), values(capacity), times(capacity) {
+
+    }
+    /**
+     * @brief Capture a readable. sample() records its current value, read with load() so that it may be written
+     * with store() from another thread.
+     * 
+     * @param r 
+     * @param capacity 
+     */
+    capture(const readable<T>& r, size_t capacity) : capture(r.name, capacity) {
+        source = &r;
+    }
+
+    /**
+     * @brief Record a value, timestamped now.
+     * 
+     * @param value 
+     */
+    void record(const T& value) {
+        record(value, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+    }
+
+    /**
+     * @brief Record a value with a timestamp in microseconds since the epoch.
+     * 
+     * @param value 
+     * @param time_us 
+     */
+    void record(const T& value, int64_t time_us) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if(h - tail.load(std::memory_order_acquire) >= values.size()) {
+            n_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        values[h % values.size()] = value;
+        times[h % values.size()] = time_us;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Record the captured readable's current value.
+     * 
+     */
+    void sample() {
+        if(source == nullptr) return;
+        if constexpr(std::is_trivially_copyable_v<T>) record(source->load());
+        else record(source->data);
+    }
+
+    /**
+     * @brief Release the samples that were sent last tick, and pick up everything recorded since.
+     * 
+     * @return true if there is anything to send.
+     */
+    bool take() {
+        tail.store(sending_end, std::memory_order_release);
+        sending_begin = sending_end;
+        sending_end = head.load(std::memory_order_acquire);
+        return sending_end != sending_begin;
+    }
+
+    void write_json(std::string& out) const {
+        out += "{\"t\":[";
+        for(size_t i = sending_begin; i != sending_end; i ++) {
+            if(i != sending_begin) out += ',';
+            serialize::append(out, (long) times[i % times.size()]);
+        }
+        out += "],\"v\":[";
+        for(size_t i = sending_begin; i != sending_end; i ++) {
+            if(i != sending_begin) out += ',';
+            serialize::append(out, values[i % values.size()]);
+        }
+        out += "]}";
+    }
+
+    void write_binary(std::string& out) const {
+        serialize::binary::put<uint32_t>(out, sending_end - sending_begin);
+        serialize::binary::put<uint8_t>(out, serialize::binary::tag_of<T>);
+        for(size_t i = sending_begin; i != sending_end; i ++) serialize::binary::put<int64_t>(out, times[i % times.size()]);
+        for(size_t i = sending_begin; i != sending_end; i ++) serialize::binary::write(out, values[i % values.size()]);
+    }
+};
+
+/**
+ * @brief How often a bound readable is sent. Either every n-th tick, or at a target frequency
+ * (which needs mission_control::set_tick_rate() to know how often tick() is called).
+ * 
+ */
+struct send_rate {
+    unsigned int every = 1;
+    double hz = 0;
+
+    static send_rate every_n(unsigned int n) {
+        send_rate r;
+        r.every = n;
+        return r;
+    }
+    static send_rate at_hz(double hz) {
+        send_rate r;
+        r.hz = hz;
+        return r;
+    }
+};
+
+/**
+ * @brief Fixed size pool of log messages that any thread can push into without locking, and that tick() drains.
+ * Bounded multi-producer queue: each slot carries a sequence number that says whether it is free to write
+ * (sequence == position) or ready to read (sequence == position + 1). When every slot is in use, messages
+ * are dropped and counted.
+ * 
+ */
+struct log_queue {
+    static constexpr size_t max_length = 200;
+
+    struct alignas(64) slot {
+        std::atomic<size_t> sequence;
+        int64_t time;
+        // Formats the message on the sending side. nullptr for plain text.
+        void (*format)(std::string& out, const char * format, const char * args);
+        const char * fmt;
+        uint32_t length;
+        char type; // 'i' info, 'e' error
+        alignas(std::max_align_t) char data[max_length];
+    };
+    // Marks text that was cut off.
+    static constexpr std::string_view truncated = "...";
+
+    std::vector<slot> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> push_position = 0;
+    alignas(64) std::atomic<size_t> n_dropped = 0;
+    std::atomic<size_t> n_truncated = 0;
+    size_t pop_position = 0; // Only used by the draining thread.
+
+    /**
+     * @brief 
+     * 
+     * @param capacity Rounded up to a power of two.
+     */
+    log_queue(size_t capacity = 1024) : slots(std::bit_ceil(capacity)), mask(std::bit_ceil(capacity) - 1) {
+        for(size_t i = 0; i < slots.size(); i ++) slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Push a message. Text longer than max_length is cut off, and ends in "..." so it doesn't pass for
+     * the whole message.
+     * 
+     * @param type 'i' or 'e'
+     * @param text 
+     * @return false if the queue was full and the message was dropped.
+     */
+    bool push(char type, std::string_view text) {
+        slot * s = _claim();
+        if(s == nullptr) return false;
+        s->type = type;
+        s->format = nullptr;
+        if(text.size() <= max_length) {
+            s->length = text.size();
+            std::copy_n(text.data(), s->length, s->data);
+        }else {
+            s->length = max_length;
+            std::copy_n(text.data(), max_length - truncated.size(), s->data);
+            std::copy_n(truncated.data(), truncated.size(), s->data + max_length - truncated.size());
+            n_truncated.fetch_add(1, std::memory_order_relaxed);
+        }
+        _publish(s);
+        return true;
+    }
+
+    /**
+     * @brief Push a printf style message. The arguments are copied now and formatted when the message is sent, so
+     * the format string (and any char * arguments) must outlive the next tick; string literals do.
+     * 
+     * @param type 'i' or 'e'
+     * @param format 
+     * @param args Trivially copyable arguments.
+     * @return false if the queue was full and the message was dropped.
+     */
+    template<typename... Args>
+    bool push(char type, const char * format, Args... args) {
+        static_assert((std::is_trivially_copyable_v<Args> && ...), "log arguments are copied as bytes and formatted later");
+        static_assert(sizeof(std::tuple<Args...>) <= max_length, "log arguments don't fit in a slot");
+        static_assert(alignof(std::tuple<Args...>) <= alignof(std::max_align_t), "log arguments are over-aligned for a slot");
+        slot * s = _claim();
+        if(s == nullptr) return false;
+        s->type = type;
+        s->fmt = format;
+        s->format = &_format<Args...>;
+        new (s->data) std::tuple<Args...>(args...);
+        _publish(s);
+        return true;
+    }
+
+    /**
+     * @brief Pop every message pushed so far. Only one thread may drain.
+     * 
+     * @param on_message called with (type, time, formatted text)
+     */
+    template<typename F>
+    void drain(std::string& scratch, F on_message) {
+        while(true) {
+            slot& s = slots[pop_position & mask];
+            if(s.sequence.load(std::memory_order_acquire) != pop_position + 1) break;
+            scratch.clear();
+            if(s.format == nullptr) scratch.append(s.data, s.length);
+            else s.format(scratch, s.fmt, s.data);
+            on_message(s.type, s.time, scratch);
+            s.sequence.store(pop_position + slots.size(), std::memory_order_release);
+            pop_position ++;
+        }
+    }
+
+    slot * _claim() {
+        size_t position = push_position.load(std::memory_order_relaxed);
+        while(true) {
+            slot& s = slots[position & mask];
+            size_t sequence = s.sequence.load(std::memory_order_acquire);
+            if(sequence == position) {
+                if(push_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    s.time = std::time(nullptr);
+                    return &s;
+                }
+            }else if(sequence < position + 1) {
+                // Still holds a message from the last lap.
+                n_dropped.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }else {
+                position = push_position.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void _publish(slot * s) {
+        s->sequence.store(s->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    template<typename... Args>
+    static void _format(std::string& out, const char * format, const char * data) {
+        const std::tuple<Args...>& args = *std::launder(reinterpret_cast<const std::tuple<Args...> *>(data));
+        std::apply([&](const Args&... a) {
+            char buffer[256];
+            int n = std::snprintf(buffer, sizeof(buffer), format, a...);
+            if(n < 0) return;
+            if((size_t) n < sizeof(buffer)) {
+                out.append(buffer, n);
+            }else {
+                out.resize(n);
+                std::snprintf(out.data(), n + 1, format, a...);
+            }
+        }, args);
+    }
+};
+
+/**
+ * @brief Log-linear histogram of durations in nanoseconds: 16 buckets per power of two, so any percentile read
+ * back is within 1/16 (6%) of the real value. Recording is one relaxed increment, from any thread.
+ *
+ */
+struct histogram {
+    static constexpr unsigned int sub_bits = 4;
+    static constexpr unsigned int n_sub = 1 << sub_bits;
+    // Values below n_sub get a bucket each, then n_sub buckets for each power of two up to 2^64.
+    static constexpr size_t n_buckets = n_sub + (64 - sub_bits) * n_sub;
+
+    /**
+     * @brief Read back by summary().
+     *
+     */
+    struct summary_t {
+        uint64_t count = 0;
+        uint64_t p50 = 0;
+        uint64_t p90 = 0;
+        uint64_t p99 = 0;
+        uint64_t max = 0;
+    };
+
+    std::array<std::atomic<uint64_t>, n_buckets> buckets{};
+    std::atomic<uint64_t> largest = 0;
+
+    static size_t bucket(uint64_t v) {
+        if(v < n_sub) return v;
+        unsigned int e = std::bit_width(v) - 1;
+        return (e - sub_bits + 1) * n_sub + ((v >> (e - sub_bits)) - n_sub);
+    }
+    // Upper end of bucket i, so percentiles are never under reported.
+    static uint64_t bucket_value(size_t i) {
+        if(i < n_sub) return i;
+        unsigned int e = i / n_sub + sub_bits - 1;
+        uint64_t base = (uint64_t) (i % n_sub + n_sub) << (e - sub_bits);
+        return base + ((uint64_t) 1 << (e - sub_bits)) - 1;
+    }
+
+    void record(uint64_t v) {
+        buckets[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+        uint64_t seen = largest.load(std::memory_order_relaxed);
+        while(v > seen && !largest.compare_exchange_weak(seen, v, std::memory_order_relaxed));
+    }
+    void record(std::chrono::steady_clock::duration d) {
+        record((uint64_t) std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()));
+    }
+
+    summary_t summary() const {
+        summary_t s;
+        for(auto& b : buckets) s.count += b.load(std::memory_order_relaxed);
+        s.max = largest.load(std::memory_order_relaxed);
+        if(s.count == 0) return s;
+
+        // Rank of each percentile, rounded up, then one pass over the buckets.
+        uint64_t r50 = (s.count * 50 + 99) / 100, r90 = (s.count * 90 + 99) / 100, r99 = (s.count * 99 + 99) / 100;
+        uint64_t seen = 0;
+        for(size_t i = 0; i < n_buckets && seen < r99; i ++) {
+            uint64_t n = buckets[i].load(std::memory_order_relaxed);
+            if(n == 0) continue;
+            uint64_t before = seen;
+            seen += n;
+            uint64_t v = std::min(bucket_value(i), s.max);
+            if(before < r50 && seen >= r50) s.p50 = v;
+            if(before < r90 && seen >= r90) s.p90 = v;
+            if(seen >= r99) s.p99 = v;
+        }
+        return s;
+    }
+
+    void reset() {
+        for(auto& b : buckets) b.store(0, std::memory_order_relaxed);
+        largest.store(0, std::memory_order_relaxed);
+    }
+};
+
+/**
+ * @brief A few worker threads that run async commands away from the ticking thread. Jobs wait in a bounded queue,
+ * and submit() turns them away once max_pending are waiting. stop() lets the queued jobs finish first.
+ *
+ */
+struct command_pool {
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> pending;
+    size_t max_pending = 64;
+    bool stopping = false;
+
+    ~command_pool() {
+        stop();
+    }
+
+    void start(size_t n_workers, size_t _max_pending) {
+        stop();
+        max_pending = _max_pending;
+        for(size_t i = 0; i < n_workers; i ++) workers.emplace_back(&command_pool::_run, this);
+    }
+
+    bool running() const {
+        return !workers.empty();
+    }
+
+    /**
+     * @brief Queue a job for the next free worker.
+     *
+     * @param job
+     * @return false if max_pending jobs are already waiting and the job was not queued.
+     */
+    bool submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            if(pending.size() >= max_pending) return false;
+            pending.push_back(std::move(job));
+        }
+        wake.notify_one();
+        return true;
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(auto& worker : workers) worker.join();
+        workers.clear();
+        stopping = false;
+    }
+
+    void _run() {
+        while(true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                wake.wait(l, [this] { return stopping || !pending.empty(); });
+                if(pending.empty()) return;
+                job = std::move(pending.front());
+                pending.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+/**
+ * @brief Hands new writable values from whichever thread handles commands to the thread calling tick().
+ * Each set command parses and validates its values into a batch of pending writes, and post() pushes the
+ * batch onto a lock-free list. apply() takes every posted batch with one atomic exchange and runs their
+ * writes in the order they were posted, so the user's variables are only written by the ticking thread, and
+ * the values of one set command all land on the same tick.
+ *
+ */
+struct writable_mailbox {
+    struct batch {
+        std::vector<std::function<void()>> writes;
+        batch * next = nullptr;
+    };
+
+    std::atomic<batch *> posted = nullptr;
+
+    ~writable_mailbox() {
+        _free(posted.exchange(nullptr, std::memory_order_acquire));
+    }
+
+    /**
+     * @brief Post a batch. Any thread may post.
+     *
+     * @param b
+     */
+    void post(std::unique_ptr<batch> b) {
+        batch * node = b.release();
+        node->next = posted.load(std::memory_order_relaxed);
+        while(!posted.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    /**
+     * @brief Run the writes of everything posted so far. Only one thread may apply.
+     *
+     * @return Number of batches applied.
+     */
+    size_t apply() {
+        batch * b = posted.exchange(nullptr, std::memory_order_acquire);
+        if(b == nullptr) return 0;
+
+        // The list is newest first.
+        batch * oldest = nullptr;
+        while(b != nullptr) {
+            batch * next = b->next;
+            b->next = oldest;
+            oldest = b;
+            b = next;
+        }
+        size_t n = 0;
+        for(b = oldest; b != nullptr; b = b->next, n ++) {
+            for(auto& write : b->writes) write();
+        }
+        _free(oldest);
+        return n;
+    }
+
+    static void _free(batch * b) {
+        while(b != nullptr) {
+            batch * next = b->next;
+            delete b;
+            b = next;
+        }
+    }
 };
 
 /**
@@ -144,13 +1000,21 @@ struct mission_control {
      * 
      */
     typedef std::function<void(std::vector<std::string>)> command;
+    /**
+     * @brief A command run on the command workers. Returns its result, which may be empty.
+     * 
+     */
+    typedef std::function<std::string(std::vector<std::string>)> async_command;
 
+    /**
+     * @brief A log message being sent this tick. The text is in log_text.
+     * 
+     */
     struct log_message {
-        std::string msg;
-        std::string type;
-        time_t time;
-
-        log_message(std::string _msg, std::string _type);
+        size_t offset;
+        size_t length;
+        char type; // 'i' info, 'e' error
+        int64_t time;
     };
     // std::vector<readable> bound_readables;
     /**
@@ -169,7 +1033,8 @@ struct mission_control {
     template<typename T>
     /**
      * @brief Add a writable parameter. update(newvalue) will get run when set on this writable is called.
-     * Return the new value of the writable.
+     * Return the new value of the writable, or throw to reject it. update() runs where commands are handled;
+     * the value it returns is written to value by tick() once commands are handled, on the ticking thread.
      * 
      * @param name 
      * @param value 
@@ -183,15 +1048,37 @@ struct mission_control {
      * 
      * @param name 
      * @param t 
+     * @param rate How often to send it. Every tick by default.
      */
-    void bind_readable(std::string name, const T& t);
+    void bind_readable(std::string name, const T& t, send_rate rate = send_rate());
     template<typename T>
     /**
      * @brief Bind a readable. Ensure the variable has enough lifetime. Ensure that the type has a serialize() implemented. 
      * 
      * @param t 
+     * @param rate How often to send it. Every tick by default.
+     */
+    void bind_readable(const readable<T>& t, send_rate rate = send_rate());
+
+    template<typename... Channels>
+    /**
+     * @brief Bind every channel of a compile time schema. Ensure the schema has enough lifetime.
+     * The whole schema is sent whenever any channel of it changed.
+     * 
+     * @param s 
+     * @param rate How often to send it. Every tick by default.
+     */
+    void bind_schema(const schema<Channels...>& s, send_rate rate = send_rate());
+
+    template<typename T>
+    /**
+     * @brief Bind a capture. Everything it recorded since the last time it was sent goes out as one block.
+     * Ensure the capture has enough lifetime.
+     * 
+     * @param c 
+     * @param rate How often to send it. Every tick by default.
      */
-    void bind_readable(const readable<T>& t);
+    void bind_capture(capture<T>& c, send_rate rate = send_rate());
 
     template<typename T>
     /**
@@ -203,28 +1090,118 @@ struct mission_control {
     void set(std::string name, T value);
 
     /**
-     * @brief Add a command 
+     * @brief Add a command. Adding one with the same name replaces it. Throws if name is a builtin command
+     * (set, advertise, format, ...).
      * 
      * @param name 
      * @param _command 
      */
     void add_command(std::string name, command _command);
 
-    // template<typename... T> void printf(T&...);
-    // template<typename... T> void printf_error(T&...);
+    /**
+     * @brief Add a command that runs on the command workers instead of inside tick(), for commands that are slow
+     * (writing a file, recalibrating a sensor). Once it finishes, "name: result" (or "name: done") is logged as
+     * info, or "name: what()" as an error if it threw, and goes out in the "out" section of a later tick.
+     * It runs alongside the control loop, so it must only touch state that is safe to share with it.
+     * Without start_command_workers() it runs inline like any other command, and is reported the same way.
+     * Like add_command(), throws if name is a builtin command.
+     * 
+     * @param name 
+     * @param _command 
+     */
+    void add_async_command(std::string name, async_command _command);
+
+    /**
+     * @brief Start the worker threads that run commands added with add_async_command(). set and the other
+     * commands still run at the start of tick(). Async commands are refused (and logged as an error) while
+     * max_pending of them are waiting for a worker.
+     * 
+     * @param n_workers 
+     * @param max_pending 
+     */
+    void start_command_workers(size_t n_workers = 2, size_t max_pending = 64);
 
     /**
-     * @brief Log "info"
+     * @brief Log "info". Safe to call from any thread, doesn't lock or allocate. Text longer than
+     * log_queue::max_length bytes is cut off and ends in "...".
      * 
      * @param s 
      */
-    void log(std::string s);
+    void log(std::string_view s);
     /**
-     * @brief Log "error"
+     * @brief Log "error". Safe to call from any thread, doesn't lock or allocate.
      * 
      * @param s 
      */
-    void log_error(std::string s);
+    void log_error(std::string_view s);
+
+    /**
+     * @brief Log "info", printf style. The arguments are copied and only formatted when sent, so the format
+     * string and any char * arguments must still be valid at the next tick (string literals are).
+     * 
+     * @param format 
+     * @param args Trivially copyable arguments.
+     */
+    template<typename Arg, typename... Args>
+    void log(const char * format, const Arg& arg, const Args&... args);
+    /**
+     * @brief Log "error", printf style. See log().
+     * 
+     * @param format 
+     * @param args Trivially copyable arguments.
+     */
+    template<typename Arg, typename... Args>
+    void log_error(const char * format, const Arg& arg, const Args&... args);
+
+    /**
+     * @brief Number of log messages dropped because the log queue was full.
+     * 
+     * @return size_t 
+     */
+    size_t dropped_logs() const;
+
+    /**
+     * @brief Mission control's own health, summarized every stats interval. Durations are in microseconds and
+     * counters are totals since the start.
+     * 
+     */
+    struct self_stats {
+        double tick_p50_us = 0;
+        double tick_p90_us = 0;
+        double tick_p99_us = 0;
+        double tick_max_us = 0;
+        double commands_p99_us = 0; // Reading and running commands.
+        double serialize_p99_us = 0; // Collecting readables and building messages.
+        double broadcast_p99_us = 0; // Handing messages to clients, shared memory, udp and the recorder.
+        double ticks = 0; // Ticks in the last interval.
+        double bytes_sent = 0;
+        double frames_dropped = 0;
+        double clients = 0;
+        double commands = 0;
+        double command_errors = 0; // Unknown commands and commands that threw.
+        double parse_errors = 0; // Text that didn't parse as a command.
+        double bytes_discarded = 0; // Bytes of commands too long to read.
+    };
+
+    /**
+     * @brief The last summary of mission control's own health. See set_stats_interval().
+     * 
+     * @return const self_stats& 
+     */
+    const self_stats& stats() const { return last_stats; }
+    /**
+     * @brief Summarize tick timings and counters into stats() every n ticks (100 by default). 0 stops timing ticks.
+     * 
+     * @param n 
+     */
+    void set_stats_interval(unsigned int n);
+    /**
+     * @brief Send stats() as readables named "__mc.<field>", e.g. "__mc.tick_p99_us". They change once per stats interval.
+     * The "stats" command sends all of them once, as "__mc.stats", without binding them.
+     * 
+     * @param rate How often to send them. Every tick by default.
+     */
+    void bind_stats(send_rate rate = send_rate());
 
     /**
      * @brief Advertise all readables and commands.
@@ -237,6 +1214,47 @@ struct mission_control {
      */
     void tick();
 
+    /**
+     * @brief Only send readables that changed since the last tick, with a full keyframe every n ticks
+     * and whenever a client connects. 0 (the default) sends every readable on every tick.
+     * 
+     * @param n 
+     */
+    void set_keyframe_interval(unsigned int n);
+
+    /**
+     * @brief Tell mission control how often tick() is called, so readables bound with send_rate::at_hz()
+     * can be sent at their rate. Without it they are sent every tick.
+     * 
+     * @param hz 
+     */
+    void set_tick_rate(double hz);
+
+    /**
+     * @brief Do all socket I/O on a background thread, so that tick() never blocks on a slow client.
+     * tick() then only builds the message and queues it. Messages are dropped if queue_depth of them are
+     * already waiting. Call after connect().
+     * 
+     * @param queue_depth 
+     */
+    void start_io_thread(size_t queue_depth = 16);
+
+    /**
+     * @brief Set how many messages can be waiting for each newly connected client, and what happens once
+     * a client has that many waiting. Clients can pick their own policy with the "policy" command.
+     * 
+     * @param max_queue 
+     * @param policy 
+     */
+    void set_backpressure(size_t max_queue, net::drop_policy policy);
+
+    /**
+     * @brief Queue depth and drop count for every connected client.
+     * 
+     * @return std::vector<net::client_stats> 
+     */
+    std::vector<net::client_stats> client_stats();
+
     /**
      * @brief Connect (unix socket)
      * 
@@ -249,6 +1267,50 @@ struct mission_control {
      * @param port 
      */
     void connect(unsigned short port);
+    /**
+     * @brief Connect (shared memory at /dev/shm/name), for readers on the same machine. Can be used on its own
+     * or together with a socket, in either order. See net::shm_reader.
+     * 
+     * @param name Must start with '/'.
+     * @param capacity Bytes in the frame ring.
+     */
+    void connect_shared_memory(const char * name, size_t capacity = 1 << 22);
+
+    /**
+     * @brief Record every tick (as a binary frame, logs included) and every command recieved into segment files
+     * in directory. Writing happens on a background thread. See recording.hpp for the file layout.
+     * 
+     * @param directory 
+     * @param segment_size Bytes per segment file.
+     */
+    void start_recording(const char * directory, size_t segment_size = 64 << 20);
+    /**
+     * @brief Write out what is left and close the recording.
+     * 
+     */
+    void stop_recording();
+
+    /**
+     * @brief Send a recording to clients as if it were live. Blocks until the recording ends. Commands are still
+     * handled, so clients can switch format; advertise gets the recorded readables.
+     * 
+     * @param r 
+     * @param speed 1 for real time, 2 for twice as fast, 0 for as fast as possible.
+     * @param from Start at the last keyframe before this time (microseconds since the epoch). 0 for the start.
+     */
+    void replay(const recording::reader& r, double speed = 1, int64_t from = 0);
+    /**
+     * @brief Also send ticks over udp to address:port, unicast or multicast. Call again for more destinations,
+     * with the same format: throws if f differs from the first call.
+     * Udp only carries telemetry: connect a socket too for commands. Receivers can't ask for a keyframe, so
+     * use set_keyframe_interval() to let them catch up after joining or losing a frame.
+     * 
+     * @param address dotted ipv4
+     * @param port 
+     * @param f Format to send.
+     * @param interface Address of the interface to send multicast from (e.g. "127.0.0.1"), or nullptr for the default route.
+     */
+    void connect_udp(const char * address, unsigned short port, net::format f = net::format::json, const char * interface = nullptr);
 
 
     /**
@@ -256,8 +1318,10 @@ struct mission_control {
      * 
      */
     struct command_call {
-        std::string command;
-        std::vector<std::string> args;
+        // Views into the recieved message. Only valid while the command runs: copy them to keep them.
+        std::string_view command;
+        std::vector<std::string_view> args;
+        int client = -1; // fd of the client that sent the command
     };
 
     /**
@@ -269,93 +1333,561 @@ struct mission_control {
 
 
 private:
+    friend struct mission_control_bench;
+
     std::vector<std::pair<std::string, std::string>> bound_readables_advertisement;
     std::vector<std::pair<std::string, std::string>> bound_writables_advertisement;
 
-    std::vector<std::function<std::string(void)>> bound_readables;
+    /**
+     * @brief A bound readable, or a whole schema. write_json() appends "name":value and write_binary() appends
+     * id, value for each of its count values. changed() returns true if anything changed since the last time it was called.
+     * 
+     */
+    struct bound_readable {
+        uint16_t id; // Binary id of the first value.
+        size_t count = 1;
+        send_rate rate;
+        unsigned int decimation = 1; // Sent every decimation ticks, worked out from rate.
+        unsigned int countdown = 0; // Ticks until it is due.
+        bool pending_keyframe = false; // A keyframe went out while it wasn't due, so send it next time it is.
+        std::function<void(std::string&)> write_json;
+        std::function<void(std::string&)> write_binary;
+        std::function<bool(void)> changed;
+        std::vector<unsigned int> groups; // Subscriptions that include it.
+    };
+
+    std::vector<bound_readable> bound_readables;
+    double tick_rate = 0;
+    std::vector<serialize::binary::tag> readable_tags; // By id, like bound_readables_advertisement.
+    std::vector<size_t> sending_readables;
     std::vector<std::string> set_readables;
-    std::unordered_map<std::string, std::function<void(std::string)>> bound_writables;
-    std::unordered_map<std::string, command> commands;
 
+    /**
+     * @brief The readables picked by one set of names and prefix globs ("engine.*"), shared by every client that
+     * subscribed to exactly that set, so its frames are built once for all of them. Its index is the server group
+     * those clients are in. Group 0 is every readable and has no subscription.
+     * 
+     */
+    struct subscription {
+        std::vector<std::string> patterns; // Sorted, no duplicates.
+        size_t n_clients = 0; // Free to reuse once 0.
+        std::vector<size_t> sending; // Bound readables going to it this tick.
+        std::string json_buffer;
+        std::string binary_buffer;
+    };
+    std::vector<subscription> subscriptions;
+    std::unordered_map<int, unsigned int> client_subscriptions; // Group of every client not in group 0, by fd.
+
+    unsigned int keyframe_interval = 0;
+    unsigned int ticks_since_keyframe = 0;
+    size_t n_client_changes_seen = 0;
+    /**
+     * @brief An entry in a dispatch table. Tables are kept sorted by name when things are bound,
+     * so looking up a command or writable is a binary search that doesn't hash or allocate.
+     * 
+     */
+    template<typename F>
+    struct dispatch_entry {
+        std::string name;
+        F handler;
+        bool builtin = false;
+    };
+    typedef std::function<void(const command_call&)> command_handler;
+    // Parses and validates a value, and adds the write to the batch.
+    typedef std::function<void(std::string_view, writable_mailbox::batch&)> writable_handler;
+
+    std::vector<dispatch_entry<command_handler>> command_table;
+    std::vector<dispatch_entry<writable_handler>> writable_table;
+    writable_mailbox writables;
+    command_call parsed_call;
+
+    log_queue logs;
+    size_t n_logs_dropped_seen = 0;
+    // Messages drained from logs for this tick.
     std::vector<log_message> output_log;
+    std::string log_text;
+    std::string log_scratch;
+
+    // Reused every tick so that building a message doesn't allocate.
+    std::string json_buffer;
+    std::string binary_buffer;
 
     std::unique_ptr<net::server> server;
 
+    // Self telemetry. Each phase of a tick goes into a histogram, which is summarized into last_stats every stats_interval ticks.
+    histogram tick_time;
+    histogram command_time;
+    histogram serialize_time;
+    histogram broadcast_time;
+    unsigned int stats_interval = 100;
+    unsigned int ticks_since_stats = 0;
+    // run_command() is public, so these may be counted from other threads.
+    std::atomic<size_t> n_commands_run = 0;
+    std::atomic<size_t> n_command_errors = 0;
+    std::atomic<size_t> n_parse_errors = 0; // Text left over that didn't parse as a command.
+    std::atomic<size_t> n_async_errors = 0; // Async commands that threw or were refused.
+    self_stats last_stats;
+
+    void _update_stats();
+    void _stats(const command_call& call);
+
+    std::unique_ptr<recording::recorder> recorder;
+    size_t advertisement_generation = 0; // Bumped whenever a readable or command is added.
+    size_t recorded_generation = 0; // advertisement_generation when the last advertisement was recorded.
+    // While replaying, the recorded advertisement stands in for the bound readables.
+    const recording::reader * replaying = nullptr;
+    std::string replay_advertisement;
+    std::vector<std::string> replay_keys; // "name": by id.
+
+    void _replay_json(const recording::reader& r, const recording::record_view& tick, std::string& out);
+
+    // Declared after logs and the counters its jobs use, so the workers are stopped before those go away.
+    command_pool command_workers;
+    void _run_async(const std::string& name, const async_command& command, std::vector<std::string> args);
+
+    template<typename F>
+    static F * _find(std::vector<dispatch_entry<F>>& table, std::string_view name);
+    template<typename F>
+    static void _insert(std::vector<dispatch_entry<F>>& table, std::string name, F handler, bool builtin = false);
+    void _add_builtins();
+    void _set(const command_call& call);
+    void _format(const command_call& call);
+    void _policy(const command_call& call);
+    void _subscribe(const command_call& call);
+    void _unsubscribe(const command_call& call);
+    void _resubscribe(int fd, std::vector<std::string> patterns);
+    void _leave_subscription(int fd);
+    void _index_subscription(unsigned int group);
+    bool _subscribed(const subscription& sub, const bound_readable& bound) const;
+
+    template<typename T>
+    void _bind(std::string name, const T& t, send_rate rate, std::function<bool(void)> changed);
+    // Values that changed() can compare without serializing: by operator==, or byte for byte.
+    template<typename T>
+    static constexpr bool comparable = std::copyable<T> && (std::equality_comparable<T> || std::is_trivially_copyable_v<T>);
+    template<typename T>
+    static bool _same(const T& a, const T& b) {
+        if constexpr(std::equality_comparable<T>) return a == b;
+        else return std::memcmp(&a, &b, sizeof(T)) == 0;
+    }
+    void _add_bound(bound_readable bound, send_rate rate);
+
     void _handle_commands();
-    std::string::iterator _parse_next_command(std::string::iterator i, std::string::const_iterator end, command_call& call);
-    void _write(std::string s);
-    std::string build_msg();
+    size_t _parse_next_command(std::string_view message, command_call& call);
+    /**
+     * @brief Move everything logged since the last tick into output_log.
+     * 
+     */
+    void _drain_logs();
+    std::string_view _log_text(const log_message& message) const {
+        return std::string_view(log_text).substr(message.offset, message.length);
+    }
+    void _write(const std::string& s, net::format f = net::format::json, unsigned int group = 0);
+    /**
+     * @brief Write to every client, whatever it subscribed to.
+     * 
+     */
+    void _write_all(const std::string& s, net::format f = net::format::json);
+    void _listen(std::unique_ptr<net::server> listener);
+    void _collect_readables(bool keyframe);
+    const std::string& build_msg(bool keyframe = true);
+    const std::string& build_binary_msg(bool keyframe = true);
+    void _build_msg(std::string& out, const std::vector<size_t>& sending, bool keyframe);
+    void _build_binary_msg(std::string& out, const std::vector<size_t>& sending, bool keyframe);
+    std::string build_binary_advertisement();
 
 };
 
 template<typename T>
-std::string serialize::serialize(const std::vector<T>& s) {
-    if(s.size() == 0) return "[]";
-
-    std::string built = "[";
-
-    auto i = s.begin();
-    built += serialize(*i);
-
-    if(s.size() == 1) {
-        built += ']';
-        return built;
+std::string serialize::serialize(const std::vector<T>& s) {
+    std::string built;
+    append(built, s);
+    return built;
+}
+
+template<typename T>
+void serialize::append(std::string& out, const std::vector<T>& s) {
+    out += '[';
+    for(size_t i = 0; i < s.size(); i ++) {
+        if(i != 0) out += ',';
+        append(out, s[i]);
+    }
+    out += ']';
+}
+
+template<typename T>
+void serialize::append(std::string& out, const T& t) {
+    out += serialize(t);
+}
+
+template<serialize::described T>
+void serialize::append(std::string& out, const T& t) {
+    out += '{';
+    std::apply([&](const auto&... f) {
+        size_t i = 0;
+        ((i ++ == 0 ? void() : void(out += ','), out += f.key, append(out, t.*(f.member))), ...);
+    }, fields<T>::members);
+    out += '}';
+}
+
+namespace serialize {
+    /**
+     * @brief Split the top level of a json object into its keys and values, without copying.
+     * 
+     * @param s 
+     * @param on_field void(std::string_view key, std::string_view value). key is without quotes.
+     */
+    template<typename F>
+    void _split_object(std::string_view s, F on_field) {
+        auto is_space = [](char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; };
+        size_t i = 0;
+        auto skip = [&]() { while(i < s.size() && is_space(s[i])) i ++; };
+        skip();
+        if(i >= s.size() || s[i] != '{') throw std::invalid_argument("expected a json object");
+        i ++;
+        skip();
+        if(i < s.size() && s[i] == '}') return;
+        while(i < s.size()) {
+            skip();
+            if(i >= s.size() || s[i] != '"') throw std::invalid_argument("expected a field name");
+            size_t key_end = s.find('"', i + 1);
+            if(key_end == std::string_view::npos) break;
+            std::string_view key = s.substr(i + 1, key_end - i - 1);
+            i = key_end + 1;
+            skip();
+            if(i >= s.size() || s[i] != ':') throw std::invalid_argument("expected ':'");
+            i ++;
+
+            // The value runs to the next ',' or '}' that isn't nested or quoted.
+            size_t value_start = i;
+            int depth = 0;
+            bool quoted = false;
+            for(; i < s.size(); i ++) {
+                char c = s[i];
+                if(quoted) {
+                    if(c == '\\') i ++;
+                    else if(c == '"') quoted = false;
+                }else if(c == '"') quoted = true;
+                else if(c == '{' || c == '[') depth ++;
+                else if(depth > 0 && (c == '}' || c == ']')) depth --;
+                else if(depth == 0 && (c == ',' || c == '}')) break;
+            }
+            if(i >= s.size()) break;
+            size_t value_end = i;
+            while(value_start < value_end && is_space(s[value_start])) value_start ++;
+            while(value_end > value_start && is_space(s[value_end - 1])) value_end --;
+            on_field(key, s.substr(value_start, value_end - value_start));
+            if(s[i ++] == '}') return;
+        }
+        throw std::invalid_argument("unterminated json object");
+    }
+};
+
+template<typename T>
+T serialize::deserialize(const std::string& s) {
+    static_assert(described<T>, "No deserialize for this type. Describe it with MISSION_CONTROL_FIELDS() or specialize serialize::deserialize.");
+    T t{};
+    _split_object(s, [&](std::string_view key, std::string_view value) {
+        bool found = std::apply([&](const auto&... f) {
+            return ((f.name() == key ? (t.*(f.member) = deserialize<typename std::remove_cvref_t<decltype(f)>::type>(std::string(value)), true) : false) || ...);
+        }, fields<T>::members);
+        if(!found) throw std::invalid_argument("unknown field \"" + std::string(key) + "\"");
+    });
+    return t;
+}
+
+template<typename T>
+void mission_control::_bind(std::string name, const T& t, send_rate rate, std::function<bool(void)> changed) {
+    uint16_t id = bound_readables_advertisement.size();
+    bound_readables_advertisement.push_back(std::make_pair(name, ""));
+    readable_tags.push_back(serialize::binary::tag_of<T>);
+    advertisement_generation ++;
+
+    // "name": is escaped once here rather than every tick.
+    std::string key;
+    serialize::append(key, name);
+    key += ':';
+
+    bound_readable bound;
+    bound.id = id;
+    bound.write_json = [&t, key](std::string& out) {
+        out += key;
+        serialize::append(out, t);
+    };
+    bound.write_binary = [&t, id](std::string& out) {
+        serialize::binary::put(out, id);
+        serialize::binary::write(out, t);
+    };
+    bound.changed = std::move(changed);
+    _add_bound(std::move(bound), rate);
+}
+
+template<typename T>
+void mission_control::bind_readable(std::string name, const T& t, send_rate rate) {
+    // Plain variables have no version, so compare against the last value we saw.
+    if constexpr(comparable<T>) {
+        _bind(name, t, rate, [&t, last = std::optional<T>()]() mutable -> bool {
+            if(last.has_value() && _same(*last, t)) return false;
+            last = t;
+            return true;
+        });
+    }else {
+        // Telling whether it changed would mean serializing it, which costs as much as sending it.
+        _bind(name, t, rate, []() -> bool { return true; });
     }
+}
 
-    for(; i != s.end(); i ++) {
-        built += ',';
-        built += serialize((*i));
+template<typename T>
+void mission_control::bind_readable(const readable<T>& t, send_rate rate) {
+    if constexpr(std::is_trivially_copyable_v<T>) {
+        // Send a snapshot taken with load(), so a store() from another thread can't tear it and json and binary
+        // clients get the same value.
+        auto snapshot = std::make_shared<T>(t.data);
+        _bind(t.name, *snapshot, rate, [&t, snapshot, last = t.version, first = true]() mutable -> bool {
+            T now = t.load();
+            bool changed = first || t.version != last || !_same(now, *snapshot);
+            first = false;
+            last = t.version;
+            if(changed) *snapshot = now;
+            return changed;
+        });
+    }else if constexpr(comparable<T>) {
+        _bind(t.name, t.data, rate, [&t, last_value = std::optional<T>(), last = t.version]() mutable -> bool {
+            bool changed = !last_value.has_value() || t.version != last || !_same(*last_value, t.data);
+            last = t.version;
+            if(changed) last_value = t.data;
+            return changed;
+        });
+    }else {
+        _bind(t.name, t.data, rate, []() -> bool { return true; });
     }
-    built += ']';
-    return built;
 }
 
 template<typename T>
-void mission_control::bind_readable(std::string name, const T& t) {
-    bound_readables_advertisement.push_back(std::make_pair(name, ""));
-    bound_readables.push_back([&]() -> std::string {
-        return name + ':' + serialize::serialize(t);
-    });
+void mission_control::bind_capture(capture<T>& c, send_rate rate) {
+    uint16_t id = bound_readables_advertisement.size();
+    bound_readables_advertisement.push_back(std::make_pair(c.name, ""));
+    readable_tags.push_back(serialize::binary::samples);
+    advertisement_generation ++;
+
+    std::string key;
+    serialize::append(key, c.name);
+    key += ':';
+
+    bound_readable bound;
+    bound.id = id;
+    bound.write_json = [&c, key](std::string& out) {
+        out += key;
+        c.write_json(out);
+    };
+    bound.write_binary = [&c, id](std::string& out) {
+        serialize::binary::put(out, id);
+        c.write_binary(out);
+    };
+    // Called once per tick when due, so this is where the samples for this tick are picked up.
+    bound.changed = [&c]() -> bool {
+        return c.take();
+    };
+    _add_bound(std::move(bound), rate);
 }
 
-template<typename T>
-void mission_control::bind_readable(const readable<T>& t) {
-    bound_readables_advertisement.push_back(std::make_pair(t.name, ""));
-    bound_readables.push_back([&]() -> std::string {
-        return t.serialize();
-    });
+template<typename... Channels>
+void mission_control::bind_schema(const schema<Channels...>& s, send_rate rate) {
+    uint16_t id = bound_readables_advertisement.size();
+    (bound_readables_advertisement.push_back(std::make_pair(std::string(Channels::name), "")), ...);
+    (readable_tags.push_back(serialize::binary::tag_of<typename Channels::type>), ...);
+    advertisement_generation ++;
+
+    bound_readable bound;
+    bound.id = id;
+    bound.count = sizeof...(Channels);
+    bound.write_json = [&s](std::string& out) {
+        s.write_json(out);
+    };
+    bound.write_binary = [&s, id](std::string& out) {
+        s.write_binary(out, id);
+    };
+    bound.changed = [&s, last = s.version, first = true]() mutable -> bool {
+        bool changed = first || s.version != last;
+        first = false;
+        last = s.version;
+        return changed;
+    };
+    _add_bound(std::move(bound), rate);
 }
 
 template<typename T>
 void mission_control::add_writable(std::string name, T& value, std::function<T(T&)> update) {
     bound_writables_advertisement.push_back(std::make_pair(name, ""));
-    bound_writables[name] = [&](std::string s) {
-        T deserialized = serialize::deserialize<T>(s);
-        value = update(deserialized);
-    };
+    _insert<writable_handler>(writable_table, name, [&value, update](std::string_view s, writable_mailbox::batch& b) {
+        T deserialized = serialize::deserialize<T>(std::string(s));
+        b.writes.push_back([&value, updated = update(deserialized)]() mutable {
+            value = std::move(updated);
+        });
+    });
 }
 
 
 template<typename T>
 void mission_control::set(std::string name, T value) {
-    set_readables.push_back(name + ":" + serialize::serialize(value));
+    std::string entry;
+    serialize::append(entry, name);
+    entry += ':';
+    serialize::append(entry, value);
+    set_readables.push_back(std::move(entry));
 }
 
 void mission_control::connect(const char * path) {
-    server = net::create_server(path);
-    server->start_listening();
+    _listen(net::create_server(path));
 }
 
 void mission_control::connect(unsigned short port) {
-    server = net::create_server(port);
+    _listen(net::create_server(port));
+}
+
+void mission_control::_listen(std::unique_ptr<net::server> listener) {
+    // Keep shared memory or udp that were connected first.
+    if(!server) server = std::move(listener);
+    else server->take_listener(*listener);
     server->start_listening();
 }
 
+void mission_control::connect_shared_memory(const char * name, size_t capacity) {
+    if(!server) server = std::make_unique<net::server>(-1);
+    server->attach_shared_memory(name, capacity);
+}
+
+void mission_control::connect_udp(const char * address, unsigned short port, net::format f, const char * interface) {
+    if(!server) server = std::make_unique<net::server>(-1);
+    server->attach_udp(address, port, f, interface);
+}
+
+void mission_control::start_recording(const char * directory, size_t segment_size) {
+    recorder = std::make_unique<recording::recorder>(directory, segment_size);
+    // Record an advertisement before the first tick, whatever was bound.
+    recorded_generation = advertisement_generation - 1;
+}
+
+void mission_control::stop_recording() {
+    recorder.reset();
+}
+
+void mission_control::replay(const recording::reader& r, double speed, int64_t from) {
+    replaying = &r;
+    replay_keys.clear();
+    for(const recording::advertised& readable : r.readables) {
+        if(readable.id >= replay_keys.size()) replay_keys.resize(readable.id + 1);
+        replay_keys[readable.id].clear();
+        serialize::append(replay_keys[readable.id], readable.name);
+        replay_keys[readable.id] += ':';
+    }
+
+    recording::reader::position p = from != 0 ? r.seek_keyframe(from) : r.begin();
+    recording::record_view record;
+    auto start = std::chrono::steady_clock::now();
+    int64_t first = -1;
+    while(r.next(p, record)) {
+        if(record.header->kind == recording::command) continue;
+        if(record.header->kind == recording::advertise) {
+            replay_advertisement.assign(record.data);
+            advertise();
+            continue;
+        }
+
+        if(first < 0) first = record.header->time;
+        // Keep handling commands while waiting for the tick to be due.
+        while(true) {
+            _handle_commands();
+            writables.apply();
+            if(speed <= 0) break;
+            auto due = start + std::chrono::microseconds((int64_t) ((record.header->time - first) / speed));
+            auto now = std::chrono::steady_clock::now();
+            if(now >= due) break;
+            std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(due - now, std::chrono::milliseconds(5)));
+        }
+
+        // Replays aren't filtered by subscription.
+        if(server->count(net::format::json) > 0) {
+            _replay_json(r, record, json_buffer);
+            _write_all(json_buffer);
+        }
+        if(server->count(net::format::binary) > 0) {
+            binary_buffer.assign(record.data);
+            _write_all(binary_buffer, net::format::binary);
+        }
+    }
+    replaying = nullptr;
+}
+
+void mission_control::_replay_json(const recording::reader& r, const recording::record_view& tick, std::string& out) {
+    using recording::_get;
+    out.clear();
+    out += "{\"type\": \"update\",\"keyframe\":";
+    out += (tick.header->flags & recording::keyframe) ? "true" : "false";
+    out += ",\"data\":{";
+    bool first = true;
+    size_t offset = r.for_each_value(tick, [&](const recording::value_view& value) {
+        if(value.id >= replay_keys.size()) return;
+        if(!first) out += ',';
+        first = false;
+        out += replay_keys[value.id];
+        serialize::binary::append_json(out, value.tag, value.bytes);
+    });
+
+    // u16 n_set, (u32 length, json); u16 n_logs, (u8 type, i64 time, u32 length, message)
+    std::string_view rest = offset > 0 ? tick.data.substr(offset) : std::string_view();
+    if(rest.size() >= 2) {
+        size_t n_set = _get<uint16_t>(rest.data());
+        rest.remove_prefix(2);
+        for(size_t i = 0; i < n_set && rest.size() >= 4 && rest.size() - 4 >= _get<uint32_t>(rest.data()); i ++) {
+            uint32_t length = _get<uint32_t>(rest.data());
+            if(!first) out += ',';
+            first = false;
+            out += rest.substr(4, length);
+            rest.remove_prefix(4 + length);
+        }
+    }
+    out += '}';
+    if(rest.size() >= 2 && _get<uint16_t>(rest.data()) > 0) {
+        size_t n_logs = _get<uint16_t>(rest.data());
+        rest.remove_prefix(2);
+        out += ",\"out\":[";
+        for(size_t i = 0; i < n_logs && rest.size() >= 13 && rest.size() - 13 >= _get<uint32_t>(rest.data() + 9); i ++) {
+            uint32_t length = _get<uint32_t>(rest.data() + 9);
+            if(i > 0) out += ',';
+            out += "{\"msg\":";
+            serialize::append(out, rest.substr(13, length));
+            out += ",\"type\":\"";
+            out += rest[0] == 'e' ? "error" : "info";
+            out += "\",\"time\":";
+            serialize::append(out, (long) _get<int64_t>(rest.data() + 1));
+            out += '}';
+            rest.remove_prefix(13 + length);
+        }
+        out += ']';
+    }
+    out += "}\x1f";
+}
+
+void mission_control::start_io_thread(size_t queue_depth) {
+    server->start_thread(queue_depth);
+}
+
+void mission_control::set_backpressure(size_t max_queue, net::drop_policy policy) {
+    server->default_max_queue = max_queue;
+    server->default_policy = policy;
+}
+
+std::vector<net::client_stats> mission_control::client_stats() {
+    return server->stats();
+}
+
 mission_control::mission_control() {
+    _add_builtins();
 
 }
 
-mission_control::mission_control(const char * path) {
+mission_control::mission_control(const char * path) : mission_control() {
     connect(path);
 }
 
@@ -363,6 +1895,19 @@ void mission_control::advertise() {
     printf("Advertising...\n");
     std::string msg = "{\"type\": \"advertise\"";
 
+    if(replaying != nullptr) {
+        msg += ",\"readables\":{";
+        for(size_t i = 0; i < replaying->readables.size(); i ++) {
+            if(i > 0) msg += ",";
+            serialize::append(msg, replaying->readables[i].name);
+            msg += ":\"\"";
+        }
+        msg += "},\"commands\":[]}\x1f";
+        _write_all(msg);
+        if(server->count(net::format::binary) > 0 && !replay_advertisement.empty()) _write_all(replay_advertisement, net::format::binary);
+        return;
+    }
+
     {
         msg += ",\"readables\":{";
         bool first = true;
@@ -378,17 +1923,19 @@ void mission_control::advertise() {
 
         msg += ",\"commands\":[";
         bool first = true;
-        for(auto i = commands.begin(); i != commands.end(); i ++) {
+        for(auto& entry : command_table) {
+            if(entry.builtin) continue;
             if(first) first = false;
             else msg += ",";
-            msg += "\"" + (*i).first + "\"";
+            msg += "\"" + entry.name + "\"";
         }
         msg += "]";
     }
 
     msg += "}\x1f";
 
-    _write(msg);
+    _write_all(msg);
+    if(server->count(net::format::binary) > 0) _write_all(build_binary_advertisement(), net::format::binary);
 
     printf("Finished advertising\n");
 }
@@ -413,18 +1960,25 @@ void mission_control::advertise() {
  *              ]
  *          }
 */
-std::string mission_control::build_msg() {
-    std::string out = "{\"type\": \"update\",";
+const std::string& mission_control::build_msg(bool keyframe) {
+    _build_msg(json_buffer, sending_readables, keyframe);
+    return json_buffer;
+}
+
+void mission_control::_build_msg(std::string& out, const std::vector<size_t>& sending, bool keyframe) {
+    out.clear();
+    out += "{\"type\": \"update\",";
+    out += keyframe ? "\"keyframe\":true," : "\"keyframe\":false,";
     {
         out += "\"data\":{";
         bool first = true;
-        for(size_t i = 0; i < bound_readables.size(); i ++) {
+        for(size_t i : sending) {
             if(first) {
                 first = false;
             }else {
                 out += ',';
             }
-            out += bound_readables[i]();
+            bound_readables[i].write_json(out);
         }
         for(size_t i = 0; i < set_readables.size(); i ++) {
             if(first) {
@@ -446,140 +2000,796 @@ std::string mission_control::build_msg() {
             }else {
                 out += ',';
             }
-            out += "{\"msg\":\"" + output_log[i].msg + "\",\"type\":\"" + output_log[i].type + "\",\"time\":"+std::to_string(output_log[i].time)+"}";
+            out += "{\"msg\":";
+            serialize::append(out, _log_text(output_log[i]));
+            out += ",\"type\":\"";
+            out += output_log[i].type == 'e' ? "error" : "info";
+            out += "\",\"time\":";
+            serialize::append(out, (long) output_log[i].time);
+            out += '}';
         }
         out += "]";
     }
     out += "}\x1f";
+}
+
+void mission_control::_collect_readables(bool keyframe) {
+    sending_readables.clear();
+    for(size_t i = 0; i < bound_readables.size(); i ++) {
+        bound_readable& bound = bound_readables[i];
+        // Skip readables that aren't due this tick, even on keyframes. They go out in full when they are next due.
+        if(bound.countdown > 0) {
+            bound.countdown --;
+            if(keyframe) bound.pending_keyframe = true;
+            continue;
+        }
+        bound.countdown = bound.decimation - 1;
+
+        // Always run changed() so that the next delta is relative to what was just sent.
+        if(bound.changed() || keyframe || bound.pending_keyframe) sending_readables.push_back(i);
+        bound.pending_keyframe = false;
+    }
+}
+
+void mission_control::_add_bound(bound_readable bound, send_rate rate) {
+    bound.rate = rate;
+    if(rate.hz > 0) bound.decimation = tick_rate > 0 ? std::max(1.0, std::round(tick_rate / rate.hz)) : 1;
+    else bound.decimation = std::max(1u, rate.every);
+    // Stagger readables with the same rate so they don't all land on the same tick.
+    bound.countdown = bound.id % bound.decimation;
+    for(unsigned int g = 1; g < subscriptions.size(); g ++) {
+        if(subscriptions[g].n_clients > 0 && _subscribed(subscriptions[g], bound)) bound.groups.push_back(g);
+    }
+    bound_readables.push_back(std::move(bound));
+}
+
+void mission_control::set_tick_rate(double hz) {
+    tick_rate = hz;
+    for(auto& bound : bound_readables) {
+        if(bound.rate.hz <= 0) continue;
+        bound.decimation = tick_rate > 0 ? std::max(1.0, std::round(tick_rate / bound.rate.hz)) : 1;
+        bound.countdown = bound.id % bound.decimation;
+    }
+}
+
+/**
+ *      Binary format::
+ *          Every frame is a u32 length (not counting the length itself) followed by a u8 frame type.
+ *          All numbers are little-endian.
+ * 
+ *          'A' (advertise):
+ *              u16 n_readables, then for each: u16 id, u8 type tag, u16 name length, name
+ *              u16 n_commands, then for each: u16 name length, name
+ *          'T' (tick):
+ *              u8 keyframe
+ *              u16 n_values, then for each: u16 id, value (see serialize::binary::tag)
+ *              u16 n_set, then for each: u32 length, "name":json from set()
+ *              u16 n_logs, then for each: u8 'i'|'e', i64 time, u32 length, message
+*/
+std::string mission_control::build_binary_advertisement() {
+    using serialize::binary::put;
+    std::string out;
+    put<uint32_t>(out, 0);
+    out += 'A';
+
+    put<uint16_t>(out, bound_readables_advertisement.size());
+    for(size_t i = 0; i < bound_readables_advertisement.size(); i ++) {
+        const std::string& name = bound_readables_advertisement[i].first;
+        put<uint16_t>(out, i);
+        put<uint8_t>(out, readable_tags[i]);
+        put<uint16_t>(out, name.size());
+        out += name;
+    }
+
+    size_t n_commands = 0;
+    for(auto& entry : command_table) {
+        if(!entry.builtin) n_commands ++;
+    }
+    put<uint16_t>(out, n_commands);
+    for(auto& entry : command_table) {
+        if(entry.builtin) continue;
+        put<uint16_t>(out, entry.name.size());
+        out += entry.name;
+    }
+
+    serialize::binary::finish_frame(out);
     return out;
 }
 
-std::string::iterator mission_control::_parse_next_command(std::string::iterator i, std::string::const_iterator end, command_call& call) {
-    call.command = "";
+const std::string& mission_control::build_binary_msg(bool keyframe) {
+    _build_binary_msg(binary_buffer, sending_readables, keyframe);
+    return binary_buffer;
+}
+
+void mission_control::_build_binary_msg(std::string& out, const std::vector<size_t>& sending, bool keyframe) {
+    using serialize::binary::put;
+    out.clear();
+    put<uint32_t>(out, 0);
+    out += 'T';
+    put<uint8_t>(out, keyframe);
+
+    size_t n_values = 0;
+    for(size_t i : sending) n_values += bound_readables[i].count;
+    put<uint16_t>(out, n_values);
+    for(size_t i : sending) {
+        bound_readables[i].write_binary(out);
+    }
+
+    put<uint16_t>(out, set_readables.size());
+    for(size_t i = 0; i < set_readables.size(); i ++) {
+        put<uint32_t>(out, set_readables[i].size());
+        out += set_readables[i];
+    }
+
+    put<uint16_t>(out, output_log.size());
+    for(size_t i = 0; i < output_log.size(); i ++) {
+        put<uint8_t>(out, output_log[i].type);
+        put<int64_t>(out, output_log[i].time);
+        put<uint32_t>(out, output_log[i].length);
+        out += _log_text(output_log[i]);
+    }
+
+    serialize::binary::finish_frame(out);
+}
+
+/**
+ * Splits the next command off the front of a message in one pass, without copying. Command name and
+ * arguments are seperated by whitespace, and the command ends with a ';'. Whitespace and ';' inside
+ * quotes don't count, and quotes are kept in the argument (see serialize::deserialize<std::string>). Inside
+ * quotes a '\\' escapes the character after it, as in json.
+ * Whitespace inside {} or [] doesn't count either, so json values like {"x": 1, "y": 2} stay one argument.
+ * Returns how much of the message was used, or npos if there is no complete command left.
+ */
+size_t mission_control::_parse_next_command(std::string_view message, command_call& call) {
+    call.command = std::string_view();
     call.args.clear();
 
-    bool quotes = false;
-    auto j = i;
+    bool quoted = false;
+    int depth = 0;
+    size_t token_start = 0;
+    for(size_t i = 0; i < message.size(); i ++) {
+        char c = message[i];
+        if(quoted && c == '\\') {
+            i ++; // Escaped, so it can't end the quotes.
+            continue;
+        }
+        if(c == '"') quoted = !quoted;
+        if(quoted) continue;
+        if(c == '{' || c == '[') depth ++;
+        else if((c == '}' || c == ']') && depth > 0) depth --;
+        // A ';' ends the command even inside braces, so an unbalanced one can't swallow the ones after it.
+        // The framer also ends commands at '\x1f', and passes it on with the command.
+        bool end = c == ';' || c == '\x1f';
+        if(!end && (depth > 0 || (c != ' ' && c != '\t' && c != '\n' && c != '\r'))) continue;
+        depth = 0;
+
+        if(i > token_start) {
+            std::string_view token = message.substr(token_start, i - token_start);
+            if(call.command.empty()) call.command = token;
+            else call.args.push_back(token);
+        }
+        token_start = i + 1;
+        if(end) return i + 1;
+    }
+
+    return std::string_view::npos;
+}
+
+template<typename F>
+F * mission_control::_find(std::vector<dispatch_entry<F>>& table, std::string_view name) {
+    auto i = std::lower_bound(table.begin(), table.end(), name, [](const dispatch_entry<F>& entry, std::string_view name) {
+        return entry.name < name;
+    });
+    if(i == table.end() || i->name != name) return nullptr;
+    return &i->handler;
+}
+
+template<typename F>
+void mission_control::_insert(std::vector<dispatch_entry<F>>& table, std::string name, F handler, bool builtin) {
+    auto i = std::lower_bound(table.begin(), table.end(), name, [](const dispatch_entry<F>& entry, const std::string& name) {
+        return entry.name < name;
+    });
+    if(i != table.end() && i->name == name) {
+        // Replacing set or format would take them away from every client.
+        if(i->builtin) {
+            throw std::runtime_error("\"" + name + "\" is a builtin command");
+        }
+        i->handler = std::move(handler);
+        i->builtin = builtin;
+        return;
+    }
+    table.insert(i, dispatch_entry<F>{ std::move(name), std::move(handler), builtin });
+}
+
+void mission_control::_add_builtins() {
+    _insert<command_handler>(command_table, "set", [this](const command_call& call) { _set(call); }, true);
+    _insert<command_handler>(command_table, "advertise", [this](const command_call&) { advertise(); }, true);
+    _insert<command_handler>(command_table, "format", [this](const command_call& call) { _format(call); }, true);
+    _insert<command_handler>(command_table, "policy", [this](const command_call& call) { _policy(call); }, true);
+    _insert<command_handler>(command_table, "stats", [this](const command_call& call) { _stats(call); }, true);
+    _insert<command_handler>(command_table, "subscribe", [this](const command_call& call) { _subscribe(call); }, true);
+    _insert<command_handler>(command_table, "unsubscribe", [this](const command_call& call) { _unsubscribe(call); }, true);
+}
 
-    while(!((*j == ';' || *j == ' ') && !quotes)) {
-        if(j == end) return j;
-        if(*i == '"') quotes = !quotes;
-        call.command += *j;
-        j ++;
+// "set name value [name value ...]" writes all of the values on the same tick, or none of them if any is rejected
+void mission_control::_set(const command_call& call) {
+    if(call.args.empty() || call.args.size() % 2 != 0) {
+        log_error("set takes name value pairs.");
+        return;
     }
 
-    while(!(*j == ';' && !quotes)) {
-        if(j == end) return j;
-        if(*i == '"') quotes = !quotes;
-        j++;
-        std::string arg = "";
-        while(!((*j == ' ' || *j == ';') && !quotes)) {
-            if(j == end) return j;
-            if(*i == '"') quotes = !quotes;
-            arg += *j;
-            j ++;
+    auto b = std::make_unique<writable_mailbox::batch>();
+    b->writes.reserve(call.args.size() / 2);
+    for(size_t i = 0; i < call.args.size(); i += 2) {
+        writable_handler * writable = _find(writable_table, call.args[i]);
+        if(writable == nullptr) {
+            log_error("\"" + std::string(call.args[i]) + "\" is not a writable parameter.");
+            return;
         }
-        if(arg.length() != 0) call.args.push_back(arg);
+        // A value that doesn't parse, or that update() rejects, throws out of here and drops the whole batch.
+        (*writable)(call.args[i + 1], *b);
     }
+    writables.post(std::move(b));
+}
 
-    return j;
+// "format json|binary" picks the format sent to this client
+void mission_control::_format(const command_call& call) {
+    if(call.args.size() != 1) return;
+    if(call.args[0] == "binary") server->set_format(call.client, net::format::binary);
+    else if(call.args[0] == "json") server->set_format(call.client, net::format::json);
+    // The client gets a keyframe in its new format once the change is applied, see tick().
 }
 
-void mission_control::run_command(const command_call& call) {
-    ::printf("\"%s\" command recieved\n", call.command.c_str());
-    if(call.command == "set") { // "set" command is built-in
-        if(call.args.size() != 2) return;
-
-        std::string name = call.args[0];
-        std::string value = call.args[1];
-
-        if(bound_writables.count(name) > 0) bound_writables[name](value);
-        else log_error("\\\""+name+"\\\" is not a writable parameter.");
-    }else if(call.command == "advertise"){
-        advertise();
-    }else if(commands.count(call.command) > 0) {
-        printf("Command found\n");
-        try {
-            commands[call.command](call.args);
-        }catch(std::exception e) {
-            // Should only log errors. Fatal errors here could brick.
-        };
+// "policy oldest|latest|disconnect" picks what happens when this client falls behind
+void mission_control::_policy(const command_call& call) {
+    if(call.args.size() != 1) return;
+    if(call.args[0] == "oldest") server->set_policy(call.client, net::drop_policy::drop_oldest);
+    else if(call.args[0] == "latest") server->set_policy(call.client, net::drop_policy::latest_only);
+    else if(call.args[0] == "disconnect") server->set_policy(call.client, net::drop_policy::disconnect);
+}
+
+// "subscribe name prefix.* ..." adds to the readables sent to this client. Until it subscribes, a client gets all of them.
+void mission_control::_subscribe(const command_call& call) {
+    if(call.args.empty()) return;
+    if(call.client == net::shared_memory_fd) {
+        // Shared memory readers share one ring, which always carries every readable.
+        log_error("Shared memory can't subscribe.");
+        return;
+    }
+    std::vector<std::string> patterns;
+    auto current = client_subscriptions.find(call.client);
+    if(current != client_subscriptions.end()) patterns = subscriptions[current->second].patterns;
+    for(std::string_view arg : call.args) {
+        patterns.push_back(arg.starts_with('"') ? serialize::deserialize<std::string>(std::string(arg)) : std::string(arg));
+    }
+    _resubscribe(call.client, std::move(patterns));
+}
+
+// "unsubscribe name prefix.* ..." removes patterns as they were subscribed. "unsubscribe" alone goes back to every readable.
+void mission_control::_unsubscribe(const command_call& call) {
+    if(call.client == net::shared_memory_fd) {
+        log_error("Shared memory can't unsubscribe.");
+        return;
+    }
+    auto current = client_subscriptions.find(call.client);
+    if(current == client_subscriptions.end()) return;
+    if(call.args.empty()) {
+        _leave_subscription(call.client);
+        server->set_group(call.client, 0);
+        return;
+    }
+
+    std::vector<std::string> patterns = subscriptions[current->second].patterns;
+    for(std::string_view arg : call.args) {
+        std::string pattern = arg.starts_with('"') ? serialize::deserialize<std::string>(std::string(arg)) : std::string(arg);
+        std::erase(patterns, pattern);
+    }
+    _resubscribe(call.client, std::move(patterns));
+}
+
+void mission_control::_resubscribe(int fd, std::vector<std::string> patterns) {
+    std::sort(patterns.begin(), patterns.end());
+    patterns.erase(std::unique(patterns.begin(), patterns.end()), patterns.end());
+    if(subscriptions.empty()) subscriptions.resize(1); // Group 0 is everything.
+
+    // Share the group of any client that asked for the same set. Otherwise take a free one.
+    unsigned int group = 0, free = 0;
+    for(unsigned int g = 1; g < subscriptions.size() && group == 0; g ++) {
+        if(subscriptions[g].n_clients == 0) {
+            if(free == 0) free = g;
+        }else if(subscriptions[g].patterns == patterns) {
+            group = g;
+        }
+    }
+    auto current = client_subscriptions.find(fd);
+    if(current != client_subscriptions.end() && current->second == group) return;
+
+    if(group == 0) {
+        if(free == 0 && subscriptions.size() >= net::server::max_groups) {
+            log_error("Too many different subscriptions, not subscribing.");
+            return;
+        }
+        group = free != 0 ? free : subscriptions.size();
+        if(free == 0) subscriptions.emplace_back();
+        subscriptions[group].patterns = std::move(patterns);
+        subscriptions[group].n_clients = 1;
+        _index_subscription(group);
     }else {
-        // No command.
+        subscriptions[group].n_clients ++;
     }
+
+    _leave_subscription(fd);
+    client_subscriptions[fd] = group;
+    server->set_group(fd, group);
 }
 
+void mission_control::_leave_subscription(int fd) {
+    auto current = client_subscriptions.find(fd);
+    if(current == client_subscriptions.end()) return;
+    subscription& sub = subscriptions[current->second];
+    client_subscriptions.erase(current);
+    if(-- sub.n_clients > 0) return;
+
+    // Nobody left, so take it out of the index until it is reused.
+    unsigned int group = &sub - subscriptions.data();
+    sub.patterns.clear();
+    _index_subscription(group);
+}
 
-void mission_control::_handle_commands() {
-    // ::printf("Getting messages\n");
-    std::vector<std::string> messages = server->process_incoming();
-    // ::printf("Messages:\n");
-    // int i = 1;
-    // for(auto& message : messages) {
-    //     ::printf("%3d : %s\n", i++, message.c_str());
-    // }
-    for(auto& message : messages) {
-        std::string incoming_msg = message;
-        ::printf("cmd: %s\n", incoming_msg.c_str());
-
-        auto i = incoming_msg.begin();
-        auto end = incoming_msg.end();
-        command_call call;
-        bool parsing = true;
-        while(parsing) {
-            auto j = _parse_next_command(i, end, call);
-            // Advance iterator and run command, unless there is no more message, then add the rest of the message to remaining message.
-            if(j == end) {
-                // remaining_message = std::string(i, end);
-                // ::printf("rem: \"%s\"\n", remaining_message.c_str());
-                parsing = false;
-            }else {
-                
-                // std::cout << call.command << std::endl;
-                run_command(call);
+void mission_control::_index_subscription(unsigned int group) {
+    const subscription& sub = subscriptions[group];
+    for(bound_readable& bound : bound_readables) {
+        std::erase(bound.groups, group);
+        if(sub.n_clients > 0 && _subscribed(sub, bound)) bound.groups.push_back(group);
+    }
+}
 
-                i = j+1;
-            }
+bool mission_control::_subscribed(const subscription& sub, const bound_readable& bound) const {
+    // A schema is one bound readable, so subscribing to any of its channels sends all of it.
+    for(size_t i = bound.id; i < bound.id + bound.count; i ++) {
+        std::string_view name = bound_readables_advertisement[i].first;
+        for(const std::string& pattern : sub.patterns) {
+            if(pattern.ends_with('*') ? name.starts_with(std::string_view(pattern).substr(0, pattern.size() - 1)) : name == pattern) return true;
         }
     }
+    return false;
+}
+
+void mission_control::run_command(const command_call& call) {
+    command_handler * handler = _find(command_table, call.command);
+    if(handler == nullptr) { // No command.
+        n_command_errors.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    n_commands_run.fetch_add(1, std::memory_order_relaxed);
+    try {
+        (*handler)(call);
+    }catch(std::exception& e) {
+        // Should only log errors. Fatal errors here could brick.
+        n_command_errors.fetch_add(1, std::memory_order_relaxed);
+        log_error(e.what());
+    };
+}
+
+
+void mission_control::_handle_commands() {
+    // Without an I/O thread, data points straight into the client's buffer.
+    server->process_incoming([this](int fd, std::string_view data) {
+        if(data.empty()) {
+            // The client disconnected.
+            _leave_subscription(fd);
+            return;
+        }
+        if(recorder) recorder->record(recording::command, data, 0, fd);
+
+        std::string_view remaining = data;
+        parsed_call.client = fd;
+        while(true) {
+            size_t used = _parse_next_command(remaining, parsed_call);
+            if(used == std::string_view::npos) break;
+            if(!parsed_call.command.empty()) run_command(parsed_call);
+            remaining.remove_prefix(used);
+        }
+        // e.g. an unterminated quote, which hides the ';' after it.
+        if(remaining.find_first_not_of(" \t\r\n") != std::string_view::npos) n_parse_errors.fetch_add(1, std::memory_order_relaxed);
+    });
+}
+
+void mission_control::log(std::string_view message) {
+    logs.push('i', message);
+}
+void mission_control::log_error(std::string_view message) {    
+    logs.push('e', message);
+}
+
+template<typename Arg, typename... Args>
+void mission_control::log(const char * format, const Arg& arg, const Args&... args) {
+    logs.push('i', format, arg, args...);
+}
+template<typename Arg, typename... Args>
+void mission_control::log_error(const char * format, const Arg& arg, const Args&... args) {
+    logs.push('e', format, arg, args...);
 }
 
-void mission_control::log(std::string message) {
-    // printf("Logging %s\n", message.c_str());
-    output_log.emplace_back(message, "info");
+size_t mission_control::dropped_logs() const {
+    return logs.n_dropped.load(std::memory_order_relaxed);
 }
-void mission_control::log_error(std::string message) {    
-    output_log.emplace_back(message, "error");
+
+void mission_control::_drain_logs() {
+    logs.drain(log_scratch, [this](char type, int64_t time, const std::string& text) {
+        output_log.push_back({ log_text.size(), text.size(), type, time });
+        log_text += text;
+    });
+    size_t n_dropped = dropped_logs();
+    if(n_dropped != n_logs_dropped_seen) {
+        size_t offset = log_text.size();
+        serialize::append(log_text, (long) (n_dropped - n_logs_dropped_seen));
+        log_text += " log messages dropped, the log queue was full.";
+        output_log.push_back({ offset, log_text.size() - offset, 'e', std::time(nullptr) });
+        n_logs_dropped_seen = n_dropped;
+    }
 }
 
 void mission_control::tick() { 
-    
-    // Check incoming commands.
+    bool timed = stats_interval != 0;
+    std::chrono::steady_clock::time_point start, handled, built, sent;
+    if(timed) start = std::chrono::steady_clock::now();
+
+    // Check incoming commands, then write every value set since the last tick in one go.
     _handle_commands();
+    writables.apply();
+    if(timed) handled = std::chrono::steady_clock::now();
+    _drain_logs();
+
+    // Send everything on a keyframe, or if someone new connected (or changed format, or missed a message) since the last one.
+    // A tick dropped because the I/O thread's queue was full left every client behind too.
+    size_t n_client_changes = server->n_accepted + server->n_format_changes + server->n_group_changes + server->n_client_drops + server->n_dropped;
+    bool keyframe = keyframe_interval == 0 || ticks_since_keyframe >= keyframe_interval || n_client_changes != n_client_changes_seen;
+    // The recorder starts every segment with a keyframe, so each one can be played back on its own.
+    if(recorder && recorder->want_keyframe.exchange(false, std::memory_order_relaxed)) keyframe = true;
+    if(keyframe) {
+        ticks_since_keyframe = 1;
+        n_client_changes_seen = n_client_changes;
+    }else {
+        ticks_since_keyframe ++;
+    }
+    _collect_readables(keyframe);
+
+    // Construct output string. Only build the formats someone is listening for.
+    bool send_json = server->count(net::format::json, 0) > 0;
+    bool send_binary = server->count(net::format::binary, 0) > 0;
+    if(send_json) build_msg(keyframe);
+    if(send_binary || recorder) build_binary_msg(keyframe);
+    // Once per subscription, not once per client.
+    if(!client_subscriptions.empty()) {
+        for(subscription& sub : subscriptions) sub.sending.clear();
+        for(size_t i : sending_readables) {
+            for(unsigned int g : bound_readables[i].groups) subscriptions[g].sending.push_back(i);
+        }
+        for(unsigned int g = 1; g < subscriptions.size(); g ++) {
+            subscription& sub = subscriptions[g];
+            if(sub.n_clients == 0) continue;
+            if(server->count(net::format::json, g) > 0) _build_msg(sub.json_buffer, sub.sending, keyframe);
+            if(server->count(net::format::binary, g) > 0) _build_binary_msg(sub.binary_buffer, sub.sending, keyframe);
+        }
+    }
+    if(timed) built = std::chrono::steady_clock::now();
+
+    if(send_json) _write(json_buffer);
+    if(send_binary || recorder) {
+        const std::string& message = binary_buffer;
+        if(send_binary) _write(message, net::format::binary);
+        if(recorder) {
+            // Ids in the tick frames only mean something next to the advertisement, so record a new one when it changes.
+            if(advertisement_generation != recorded_generation) {
+                recorder->record(recording::advertise, build_binary_advertisement());
+                recorded_generation = advertisement_generation;
+            }
+            recorder->record(recording::tick, message, keyframe ? recording::keyframe : 0);
+        }
+    }
+    if(!client_subscriptions.empty()) {
+        for(unsigned int g = 1; g < subscriptions.size(); g ++) {
+            subscription& sub = subscriptions[g];
+            if(sub.n_clients == 0) continue;
+            if(server->count(net::format::json, g) > 0) _write(sub.json_buffer, net::format::json, g);
+            if(server->count(net::format::binary, g) > 0) _write(sub.binary_buffer, net::format::binary, g);
+        }
+    }
 
     // Reset the update_changes;
     set_readables.clear();
     output_log.clear();
+    log_text.clear();
+
+    if(timed) {
+        sent = std::chrono::steady_clock::now();
+        command_time.record(handled - start);
+        serialize_time.record(built - handled);
+        broadcast_time.record(sent - built);
+        tick_time.record(sent - start);
+        if(++ ticks_since_stats >= stats_interval) _update_stats();
+    }
+}
 
-    
-    // Construct output string.
-    _write(build_msg());
+void mission_control::set_stats_interval(unsigned int n) {
+    stats_interval = n;
+    ticks_since_stats = 0;
+}
+
+void mission_control::_update_stats() {
+    auto us = [](uint64_t ns) { return ns / 1000.0; };
+    histogram::summary_t tick = tick_time.summary();
+    last_stats.tick_p50_us = us(tick.p50);
+    last_stats.tick_p90_us = us(tick.p90);
+    last_stats.tick_p99_us = us(tick.p99);
+    last_stats.tick_max_us = us(tick.max);
+    last_stats.commands_p99_us = us(command_time.summary().p99);
+    last_stats.serialize_p99_us = us(serialize_time.summary().p99);
+    last_stats.broadcast_p99_us = us(broadcast_time.summary().p99);
+    last_stats.ticks = tick.count;
+    last_stats.bytes_sent = server->n_bytes_sent.load(std::memory_order_relaxed);
+    last_stats.frames_dropped = server->n_dropped + server->n_client_drops;
+    last_stats.clients = server->count(net::format::json) + server->count(net::format::binary);
+    last_stats.commands = n_commands_run.load(std::memory_order_relaxed);
+    last_stats.command_errors = n_command_errors.load(std::memory_order_relaxed) + n_async_errors.load(std::memory_order_relaxed);
+    last_stats.parse_errors = n_parse_errors.load(std::memory_order_relaxed);
+    last_stats.bytes_discarded = server->n_bytes_discarded.load(std::memory_order_relaxed);
+
+    tick_time.reset();
+    command_time.reset();
+    serialize_time.reset();
+    broadcast_time.reset();
+    ticks_since_stats = 0;
+}
+
+void mission_control::bind_stats(send_rate rate) {
+    bind_readable("__mc.tick_p50_us", last_stats.tick_p50_us, rate);
+    bind_readable("__mc.tick_p90_us", last_stats.tick_p90_us, rate);
+    bind_readable("__mc.tick_p99_us", last_stats.tick_p99_us, rate);
+    bind_readable("__mc.tick_max_us", last_stats.tick_max_us, rate);
+    bind_readable("__mc.commands_p99_us", last_stats.commands_p99_us, rate);
+    bind_readable("__mc.serialize_p99_us", last_stats.serialize_p99_us, rate);
+    bind_readable("__mc.broadcast_p99_us", last_stats.broadcast_p99_us, rate);
+    bind_readable("__mc.ticks", last_stats.ticks, rate);
+    bind_readable("__mc.bytes_sent", last_stats.bytes_sent, rate);
+    bind_readable("__mc.frames_dropped", last_stats.frames_dropped, rate);
+    bind_readable("__mc.clients", last_stats.clients, rate);
+    bind_readable("__mc.commands", last_stats.commands, rate);
+    bind_readable("__mc.command_errors", last_stats.command_errors, rate);
+    bind_readable("__mc.parse_errors", last_stats.parse_errors, rate);
+    bind_readable("__mc.bytes_discarded", last_stats.bytes_discarded, rate);
+}
+
+// "stats" sends the last summary once as "__mc.stats":{...}, for clients that don't want it every tick
+void mission_control::_stats(const command_call&) {
+    const self_stats& s = last_stats;
+    std::pair<const char *, double> fields[] = {
+        { "tick_p50_us", s.tick_p50_us }, { "tick_p90_us", s.tick_p90_us }, { "tick_p99_us", s.tick_p99_us },
+        { "tick_max_us", s.tick_max_us }, { "commands_p99_us", s.commands_p99_us }, { "serialize_p99_us", s.serialize_p99_us },
+        { "broadcast_p99_us", s.broadcast_p99_us }, { "ticks", s.ticks }, { "bytes_sent", s.bytes_sent },
+        { "frames_dropped", s.frames_dropped }, { "clients", s.clients }, { "commands", s.commands },
+        { "command_errors", s.command_errors }, { "parse_errors", s.parse_errors }, { "bytes_discarded", s.bytes_discarded },
+    };
+    std::string entry = "\"__mc.stats\":{";
+    for(auto& [name, value] : fields) {
+        if(entry.back() != '{') entry += ',';
+        entry += '"';
+        entry += name;
+        entry += "\":";
+        serialize::append(entry, value);
+    }
+    entry += '}';
+    set_readables.push_back(std::move(entry));
+}
+
+void mission_control::set_keyframe_interval(unsigned int n) {
+    keyframe_interval = n;
+    ticks_since_keyframe = n;
+}
+
+void mission_control::_write(const std::string& s, net::format f, unsigned int group) {
+    server->broadcast(s, f, group);
+}
+
+void mission_control::_write_all(const std::string& s, net::format f) {
+    server->broadcast(s, f);
+    for(unsigned int g = 1; g < subscriptions.size(); g ++) {
+        if(subscriptions[g].n_clients > 0 && server->count(f, g) > 0) server->broadcast(s, f, g);
+    }
+}
+
+void serialize::append(std::string& out, const double& d) {
+    char buf[32];
+    auto [end, err] = std::to_chars(buf, buf + sizeof(buf), d);
+    out.append(buf, end);
+}
+
+void serialize::append(std::string& out, const int& d) {
+    char buf[16];
+    auto [end, err] = std::to_chars(buf, buf + sizeof(buf), d);
+    out.append(buf, end);
+}
+
+void serialize::append(std::string& out, const long& d) {
+    char buf[24];
+    auto [end, err] = std::to_chars(buf, buf + sizeof(buf), d);
+    out.append(buf, end);
+}
+
+void serialize::append(std::string& out, const std::string& d) {
+    append(out, std::string_view(d));
 }
 
-void mission_control::_write(std::string s) {
-    server->broadcast(s);
+void serialize::append(std::string& out, std::string_view d) {
+    out += '"';
+    for(char c : d) {
+        switch(c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            case '\r': out += "\\r"; break;
+            default:
+                if((unsigned char) c < 0x20) {
+                    // Json doesn't allow any other control character unescaped.
+                    static constexpr char hex[] = "0123456789abcdef";
+                    out += "\\u00";
+                    out += hex[(unsigned char) c >> 4];
+                    out += hex[c & 0xf];
+                }else {
+                    out += c;
+                }
+        }
+    }
+    out += '"';
 }
 
 std::string serialize::serialize(const double& d) {
-    return std::to_string(d);
+    std::string out;
+    append(out, d);
+    return out;
 }
 
 std::string serialize::serialize(const int& d) {
-    return std::to_string(d);
+    std::string out;
+    append(out, d);
+    return out;
 }
 
 std::string serialize::serialize(const std::string& d) {
-    return "\"" + d + "\"";
+    std::string out;
+    append(out, d);
+    return out;
+}
+
+template<typename T>
+void serialize::binary::put(std::string& out, T value) {
+    static_assert(std::is_arithmetic_v<T>);
+    if constexpr(std::is_floating_point_v<T>) {
+        using bits = std::conditional_t<sizeof(T) == 8, uint64_t, uint32_t>;
+        put(out, std::bit_cast<bits>(value));
+    }else {
+        if constexpr(std::endian::native == std::endian::big) value = std::byteswap(value);
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        out.append(bytes, sizeof(T));
+    }
+}
+
+void serialize::binary::write(std::string& out, const double& d) {
+    put(out, d);
+}
+
+void serialize::binary::write(std::string& out, const int& d) {
+    put<int32_t>(out, d);
+}
+
+void serialize::binary::write(std::string& out, const std::string& d) {
+    put<uint32_t>(out, d.size());
+    out += d;
+}
+
+void serialize::binary::write(std::string& out, const std::vector<double>& d) {
+    put<uint32_t>(out, d.size());
+    for(const double& x : d) put(out, x);
+}
+
+void serialize::binary::write(std::string& out, const std::vector<int>& d) {
+    put<uint32_t>(out, d.size());
+    for(const int& x : d) put<int32_t>(out, x);
+}
+
+template<serialize::described T>
+void serialize::binary::write(std::string& out, const T& t) {
+    constexpr size_t n_fields = std::tuple_size_v<decltype(fields<T>::members)>;
+    static_assert(n_fields < 256);
+    put<uint8_t>(out, n_fields);
+    std::apply([&](const auto&... f) {
+        ((put<uint8_t>(out, f.name().size()), out += f.name(),
+            put<uint8_t>(out, tag_of<typename std::remove_cvref_t<decltype(f)>::type>),
+            write(out, t.*(f.member))), ...);
+    }, fields<T>::members);
+}
+
+template<typename T>
+void serialize::binary::write(std::string& out, const T& t) {
+    size_t start = out.size();
+    put<uint32_t>(out, 0);
+    ::serialize::append(out, t);
+
+    uint32_t length = out.size() - start - sizeof(uint32_t);
+    if constexpr(std::endian::native == std::endian::big) length = std::byteswap(length);
+    std::memcpy(&out[start], &length, sizeof(length));
+}
+
+size_t serialize::binary::append_json(std::string& out, uint8_t t, std::string_view bytes) {
+    using recording::_get;
+    size_t size = recording::value_size(t, bytes.data(), bytes.data() + bytes.size());
+    if(size == 0) {
+        out += "null";
+        return 0;
+    }
+    const char * p = bytes.data();
+    switch(t) {
+        case f64: append(out, std::bit_cast<double>(_get<uint64_t>(p))); break;
+        case i32: append(out, (int) _get<int32_t>(p)); break;
+        case string: append(out, std::string_view(p + 4, _get<uint32_t>(p))); break;
+        case json: out.append(p + 4, _get<uint32_t>(p)); break;
+        case f64_array:
+        case i32_array: {
+            size_t count = _get<uint32_t>(p);
+            out += '[';
+            for(size_t i = 0; i < count; i ++) {
+                if(i > 0) out += ',';
+                if(t == f64_array) append(out, std::bit_cast<double>(_get<uint64_t>(p + 4 + 8 * i)));
+                else append(out, (int) _get<int32_t>(p + 4 + 4 * i));
+            }
+            out += ']';
+            break;
+        }
+        case samples: {
+            size_t count = _get<uint32_t>(p);
+            uint8_t element = p[4];
+            out += "{\"t\":[";
+            for(size_t i = 0; i < count; i ++) {
+                if(i > 0) out += ',';
+                append(out, (long) _get<int64_t>(p + 5 + 8 * i));
+            }
+            out += "],\"v\":[";
+            size_t offset = 5 + 8 * count;
+            for(size_t i = 0; i < count; i ++) {
+                if(i > 0) out += ',';
+                offset += append_json(out, element, bytes.substr(offset, size - offset));
+            }
+            out += "]}";
+            break;
+        }
+        case object: {
+            size_t n_fields = (uint8_t) p[0];
+            size_t offset = 1;
+            out += '{';
+            for(size_t i = 0; i < n_fields; i ++) {
+                size_t name_length = (uint8_t) p[offset];
+                if(i > 0) out += ',';
+                append(out, bytes.substr(offset + 1, name_length));
+                out += ':';
+                offset += 1 + name_length;
+                uint8_t field_tag = p[offset];
+                offset += 1 + append_json(out, field_tag, bytes.substr(offset + 1, size - offset - 1));
+            }
+            out += '}';
+            break;
+        }
+    }
+    return size;
+}
+
+void serialize::binary::finish_frame(std::string& frame) {
+    uint32_t length = frame.size() - sizeof(uint32_t);
+    if constexpr(std::endian::native == std::endian::big) length = std::byteswap(length);
+    std::memcpy(&frame[0], &length, sizeof(length));
 }
 
 template<>
@@ -599,12 +2809,43 @@ std::string serialize::deserialize<std::string>(const std::string& s) {
     if(length < 3) return "";
     if(s[i] != '"') return "";
     i++;
-    size_t j = i;
-    while(s[i] != '"' && i < length) {
-        i++;
+    // Undo serialize::append's escapes.
+    std::string out;
+    for(; i < length && s[i] != '"'; i ++) {
+        if(s[i] != '\\' || i + 1 >= length) {
+            out += s[i];
+            continue;
+        }
+        char c = s[++ i];
+        switch(c) {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'u': {
+                unsigned int code = 0;
+                if(i + 4 >= length || std::from_chars(s.data() + i + 1, s.data() + i + 5, code, 16).ptr != s.data() + i + 5) {
+                    throw std::invalid_argument("bad \\u escape");
+                }
+                i += 4;
+                // As utf-8.
+                if(code < 0x80) {
+                    out += (char) code;
+                }else if(code < 0x800) {
+                    out += (char) (0xc0 | (code >> 6));
+                    out += (char) (0x80 | (code & 0x3f));
+                }else {
+                    out += (char) (0xe0 | (code >> 12));
+                    out += (char) (0x80 | ((code >> 6) & 0x3f));
+                    out += (char) (0x80 | (code & 0x3f));
+                }
+                break;
+            }
+            default: out += c; // \" \\ \/
+        }
     }
-
-    return s.substr(j, i - j);
+    return out;
 }
 
 
@@ -665,14 +2906,45 @@ std::vector<std::string> serialize::deserialize<std::vector<std::string>>(const
     return out;
 }
 
-mission_control::log_message::log_message(std::string _msg, std::string _type) {
-    msg = _msg;
-    type = _type;
-    time = std::time(nullptr);
+void mission_control::add_command(std::string name, mission_control::command _command) {
+    // User commands take their arguments as strings.
+    _insert<command_handler>(command_table, name, [_command](const command_call& call) {
+        _command(std::vector<std::string>(call.args.begin(), call.args.end()));
+    });
+    advertisement_generation ++;
 }
 
-void mission_control::add_command(std::string name, mission_control::command _command) {
-    commands[name] = _command;
+void mission_control::add_async_command(std::string name, mission_control::async_command _command) {
+    _insert<command_handler>(command_table, name, [this, name, _command](const command_call& call) {
+        // The call's views only live until this returns, so the job gets its own copy of the arguments.
+        std::function<void()> job = [this, name, _command, args = std::vector<std::string>(call.args.begin(), call.args.end())]() mutable {
+            _run_async(name, _command, std::move(args));
+        };
+        if(!command_workers.running()) {
+            job();
+        }else if(!command_workers.submit(std::move(job))) {
+            n_async_errors.fetch_add(1, std::memory_order_relaxed);
+            log_error(name + ": not run, too many async commands waiting.");
+        }
+    });
+    advertisement_generation ++;
+}
+
+void mission_control::start_command_workers(size_t n_workers, size_t max_pending) {
+    command_workers.start(std::max<size_t>(1, n_workers), max_pending);
+}
+
+void mission_control::_run_async(const std::string& name, const async_command& command, std::vector<std::string> args) {
+    std::string report = name + ": ";
+    try {
+        std::string result = command(std::move(args));
+        report += result.empty() ? "done" : result;
+        log(report);
+    }catch(std::exception& e) {
+        n_async_errors.fetch_add(1, std::memory_order_relaxed);
+        report += e.what();
+        log_error(report);
+    }
 }
 
 #endif
\ No newline at end of file
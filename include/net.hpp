@@ -28,10 +28,24 @@
 #include <string>
 
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 #include <thread>
+#include <atomic>
+#include <mutex>
 #include <unordered_map>
 #include <functional>
 #include <vector>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <ctime>
+#include <bit>
+#include <algorithm>
 // #include <iostream>
 
 #define KB 1024
@@ -40,6 +54,385 @@
 #define chk_bit(a,b) ((a&b) == b)
 
 namespace net {
+    /**
+     * @brief Wire format a client asked for.
+     * 
+     */
+    enum class format {
+        json,
+        binary
+    };
+
+    /**
+     * @brief What to do when a client's send queue is full.
+     * 
+     */
+    enum class drop_policy {
+        drop_oldest, // drop the oldest queued message
+        latest_only, // drop everything queued, keep only the newest message
+        disconnect // close the connection
+    };
+
+    /**
+     * @brief An immutable message, shared by every client queue it was sent to. Frames are reference counted
+     * and go back to the server's pool once every client has sent or dropped them.
+     * 
+     */
+    struct frame {
+        std::string data;
+        size_t refs = 0;
+    };
+
+    /**
+     * @brief Splits a client's byte stream into commands ending in ';' or '\x1f' (outside of quotes).
+     * Commands are returned as views into the buffer, delimiter included, so they are only valid until the next
+     * read(). A partial command at the end of a read is kept until the rest of it arrives.
+     * Views have to be contiguous, so rather than a ring the buffer is compacted when it fills up: only the one
+     * unfinished command is moved, which is the same copy a ring makes when a command wraps around its end.
+     * 
+     */
+    struct framer {
+        std::vector<char> buffer;
+        size_t start = 0; // Start of the first unfinished command.
+        size_t scanned = 0; // Everything before this has been checked for a delimiter.
+        size_t end = 0; // End of the data in the buffer.
+        size_t max_size;
+        bool quoted = false;
+        bool escaped = false; // The last character was a '\\' inside quotes.
+        bool discarding = false; // Dropping a command that grew past max_size.
+        size_t n_discarded = 0; // Bytes dropped that way.
+        bool closed = false; // The peer shut down its side of the connection.
+
+        framer(size_t capacity = 4096, size_t max_size = 1 << 20);
+
+        /**
+         * @brief Read from fd until EAGAIN, calling on_command for every complete command.
+         * 
+         * @tparam F void(std::string_view)
+         * @param fd 
+         * @param on_command 
+         * @return false if the connection was closed or failed.
+         */
+        template<typename F>
+        bool read(int fd, F on_command);
+
+        /**
+         * @brief Get the next complete command out of what has been read so far.
+         * 
+         * @param command 
+         * @return false if there isn't a complete command.
+         */
+        bool next(std::string_view& command);
+    };
+
+    /**
+     * @brief A client's queue of frames: a ring with a fixed number of slots, allocated when the client connects,
+     * so queueing and sending never allocate.
+     * 
+     */
+    struct frame_ring {
+        std::vector<frame*> slots;
+        size_t head = 0; // Front, counting up from 0 and wrapped by slots.size().
+        size_t n = 0;
+
+        /**
+         * @brief Set the number of slots. Only while empty.
+         * 
+         * @param capacity 
+         */
+        void reset(size_t capacity);
+        size_t size() const;
+        bool empty() const;
+        frame *& operator[](size_t i); // The i'th frame from the front.
+        frame * front();
+        void push_back(frame * fr);
+        void pop_front();
+        /**
+         * @brief Remove the i'th frame from the front, moving the ones after it forward.
+         * 
+         * @param i 
+         */
+        void erase(size_t i);
+        void pop_back(size_t count);
+    };
+
+    /**
+     * @brief A connected client and the messages waiting to be sent to it.
+     * 
+     */
+    struct client {
+        int fd;
+        format f = format::json;
+        unsigned int group = 0; // Subscription group, see server::set_group(). 0 gets everything.
+        drop_policy policy;
+        size_t max_queue;
+
+        frame_ring queue; // max_queue slots, plus one for a half sent frame that can't be dropped.
+        size_t offset = 0; // Bytes of queue.front() already sent.
+        size_t n_dropped = 0;
+        bool dead = false;
+        bool want_write = false; // Registered for EPOLLOUT, only while there is a backlog.
+        bool closing = false; // Shut down its side, and is closed as soon as its queue is empty.
+
+        framer incoming;
+    };
+
+    /**
+     * @brief Per-client queue statistics.
+     * 
+     */
+    struct client_stats {
+        int fd;
+        format f;
+        size_t queue_depth;
+        size_t n_dropped;
+    };
+
+    /**
+     * @brief Data recieved from a client. A message with no data means the client disconnected.
+     * 
+     */
+    struct message {
+        int fd;
+        std::string data;
+    };
+
+    /**
+     * @brief Client id used for everything that comes in or goes out over shared memory.
+     * 
+     */
+    constexpr int shared_memory_fd = -2;
+
+    /**
+     * @brief Start of a shared memory transport. It is followed by the frame ring (capacity bytes), then the
+     * command slots. Frames in the ring are (u32 length, u32 format, data) padded to 8 bytes; a length of
+     * shm_wrap means the rest of the ring is empty and the next frame is at the start. The server writes
+     * frames without waiting for readers, so a reader that falls a whole ring behind skips ahead.
+     * 
+     */
+    struct shm_header {
+        static constexpr uint32_t magic_value = 0x4853434d; // "MCSH"
+        static constexpr uint32_t wrap = 0xffffffff;
+        static constexpr size_t command_size = 1016;
+
+        uint32_t magic;
+        uint32_t capacity; // Bytes in the frame ring, a power of two.
+        uint32_t n_command_slots; // A power of two.
+        std::atomic<uint32_t> f; // format of the frames being written.
+        std::atomic<uint64_t> reserved; // End of the frame being written. Bytes before reserved - capacity are intact.
+        std::atomic<uint64_t> written; // End of the last complete frame.
+        std::atomic<uint64_t> last; // Start of the last complete frame.
+        std::atomic<uint32_t> futex; // Bumped after every frame. Readers wait on it.
+        std::atomic<uint32_t> n_waiting;
+        std::atomic<uint64_t> n_attached; // Bumped by readers when they map the ring.
+        std::atomic<uint64_t> n_detached; // Bumped by readers when they unmap it. A reader that crashes never does.
+        std::atomic<uint64_t> command_push;
+        uint64_t command_pop; // Only used by the server.
+    };
+
+    /**
+     * @brief A command sent by a shared memory reader. Claimed and published like log_queue's slots.
+     * 
+     */
+    struct shm_command {
+        std::atomic<uint64_t> sequence;
+        uint32_t length;
+        char data[shm_header::command_size];
+    };
+
+    /**
+     * @brief A mapped shared memory transport. The server creates one with create(), readers open() it by name.
+     * 
+     */
+    struct shm_region {
+        std::string name;
+        shm_header * header = nullptr;
+        size_t size = 0;
+        bool owner = false;
+
+        shm_region() = default;
+        shm_region(const shm_region&) = delete;
+        ~shm_region();
+
+        /**
+         * @brief Create (or replace) /dev/shm/name.
+         * 
+         * @param name Must start with '/'.
+         * @param capacity Bytes in the frame ring, rounded up to a power of two.
+         * @param n_command_slots Rounded up to a power of two.
+         */
+        void create(const char * name, size_t capacity, size_t n_command_slots);
+        /**
+         * @brief Map an existing transport.
+         * 
+         * @param name 
+         */
+        void open(const char * name);
+
+        char * ring() const { return reinterpret_cast<char *>(header + 1); }
+        shm_command * commands() const { return reinterpret_cast<shm_command *>(ring() + header->capacity); }
+    };
+
+    /**
+     * @brief Server side of a shared memory transport. Publishing is a copy into the ring plus a futex wake when
+     * someone is waiting, so it happens on the thread calling broadcast() even with the I/O thread running.
+     * 
+     */
+    struct shm_writer {
+        shm_region region;
+        format f = format::json;
+        uint64_t n_attached_seen = 0;
+        bool live = false; // Whether any reader is attached, i.e. whether this counts as a client.
+        size_t n_dropped = 0; // Frames too big for the ring.
+
+        shm_writer(const char * name, size_t capacity, size_t n_command_slots, format f);
+
+        void publish(const std::string& data);
+        /**
+         * @brief Move every command readers have sent into out, each terminated with ';'.
+         * 
+         * @param out 
+         */
+        void receive(std::vector<message>& out);
+        void set_format(format f);
+    };
+
+    /**
+     * @brief Reader side of a shared memory transport, for local consumers such as the REST relay.
+     * Frames are returned as views into the mapping: read it, then check intact() before trusting what was read.
+     * 
+     */
+    struct shm_reader {
+        shm_region region;
+        uint64_t position = 0; // Start of the next frame to read.
+        uint64_t current = 0; // Start of the frame returned by next().
+        size_t n_skipped = 0; // Times the reader fell a whole ring behind.
+
+        shm_reader(const char * name);
+        ~shm_reader();
+
+        /**
+         * @brief Get the next frame, without copying.
+         * 
+         * @param frame 
+         * @param f format of the frame
+         * @return false if there is no new frame.
+         */
+        bool next(std::string_view& frame, format& f);
+        /**
+         * @brief Whether the frame returned by next() is still intact, i.e. the server hasn't written over it.
+         * 
+         */
+        bool intact() const;
+        /**
+         * @brief Block until a new frame is published or timeout_ms passes.
+         * 
+         * @param timeout_ms -1 to wait forever
+         * @return true if there is a new frame.
+         */
+        bool wait(int timeout_ms = -1);
+        /**
+         * @brief Send commands to the server, e.g. "set x 1;format binary;".
+         * 
+         * @param commands At most shm_header::command_size bytes.
+         * @return false if the command slots are full or the commands are too long.
+         */
+        bool send(std::string_view commands);
+    };
+
+    /**
+     * @brief Header at the start of every udp datagram. A frame too big for one datagram is split into
+     * fragments that share a sequence number; offset says where in the frame this one goes.
+     * All fields are little-endian.
+     * 
+     */
+    struct udp_header {
+        uint32_t sequence;
+        uint32_t length; // Of the whole frame.
+        uint32_t offset;
+        uint8_t f;
+        uint8_t reserved;
+        uint16_t fragment; // Index of this fragment in the frame.
+    };
+    static_assert(sizeof(udp_header) == 16);
+
+    /**
+     * @brief Sends every message once per destination over udp, to a multicast group or a list of unicast
+     * addresses. Nothing is retransmitted; receivers notice missing frames by sequence number.
+     * 
+     */
+    struct udp_sender {
+        int fd = -1;
+        format f;
+        size_t max_payload; // Frame bytes per datagram.
+        uint32_t sequence = 0;
+        std::vector<sockaddr_in> destinations;
+        size_t n_errors = 0; // Datagrams the kernel refused, and frames too big to split.
+
+        // Reused for every message.
+        std::vector<udp_header> headers;
+        std::vector<iovec> iovecs;
+        std::vector<mmsghdr> messages;
+
+        /**
+         * @brief 
+         * 
+         * @param f Format to send.
+         * @param interface Address of the interface to send multicast from (e.g. "127.0.0.1"), or nullptr for the default route.
+         * @param mtu Datagrams are kept under this, including ip and udp headers.
+         * @param ttl Multicast hops.
+         */
+        udp_sender(format f, const char * interface = nullptr, size_t mtu = 1500, int ttl = 1);
+        ~udp_sender();
+
+        /**
+         * @brief Send to address:port as well. Multicast addresses (224.0.0.0/4) work the same as unicast.
+         * 
+         * @param address dotted ipv4
+         * @param port 
+         */
+        void add_destination(const char * address, int port);
+        void publish(const std::string& data);
+    };
+
+    /**
+     * @brief Receives frames from a udp_sender and puts fragments back together. Never waits for a missing
+     * datagram: a frame that is still incomplete when a newer one starts is abandoned.
+     * 
+     */
+    struct udp_receiver {
+        int fd = -1;
+        bool started = false;
+        uint32_t expected = 0; // Next sequence number.
+        uint32_t assembling = 0; // Sequence of the frame in buffer.
+        size_t received = 0; // Bytes of it received so far.
+        std::vector<bool> fragments; // Which fragments of it were received, so duplicates aren't counted twice.
+        std::string buffer;
+        std::vector<char> datagram;
+
+        size_t n_lost = 0; // Frames never seen, by sequence gap.
+        size_t n_incomplete = 0; // Frames abandoned with fragments missing.
+
+        /**
+         * @brief Listen on port, joining group if it is given.
+         * 
+         * @param port 
+         * @param group multicast group, or nullptr for unicast.
+         * @param interface Address of the interface to join the group on, or nullptr for the default.
+         */
+        udp_receiver(int port, const char * group = nullptr, const char * interface = nullptr);
+        ~udp_receiver();
+
+        /**
+         * @brief Read datagrams until a frame is complete or there are none left. Doesn't block.
+         * 
+         * @param frame Valid until the next call.
+         * @param f 
+         * @return false if there is no complete frame yet.
+         */
+        bool next(std::string_view& frame, format& f);
+    };
+
     struct socket {
         int fd = -1;
         int i = -1;
@@ -58,20 +451,243 @@ namespace net {
         socket _socket;
 
         bool listening = false;
-        std::thread * thread;
+        std::thread * thread = nullptr;
+
+        /**
+         * @brief Total number of clients accepted so far.
+         * 
+         */
+        std::atomic<size_t> n_accepted = 0;
+        /**
+         * @brief Total number of format changes applied so far.
+         * 
+         */
+        std::atomic<size_t> n_format_changes = 0;
+        /**
+         * @brief Total number of subscription group changes applied so far.
+         * 
+         */
+        std::atomic<size_t> n_group_changes = 0;
+        /**
+         * @brief Messages dropped because the I/O thread's queue was full.
+         * 
+         */
+        std::atomic<size_t> n_dropped = 0;
+        /**
+         * @brief Messages dropped from any client's queue, including disconnects.
+         * 
+         */
+        std::atomic<size_t> n_client_drops = 0;
+        /**
+         * @brief Total bytes written to client sockets.
+         * 
+         */
+        std::atomic<size_t> n_bytes_sent = 0;
+        /**
+         * @brief Bytes of commands thrown away because they were longer than the framer's max_size.
+         * 
+         */
+        std::atomic<size_t> n_bytes_discarded = 0;
+
+        /**
+         * @brief Policy and queue length given to newly connected clients.
+         * 
+         */
+        drop_policy default_policy = drop_policy::drop_oldest;
+        size_t default_max_queue = 64;
+        /**
+         * @brief Connections past this many are closed as soon as they are accepted.
+         * 
+         */
+        size_t max_clients = 1024;
 
         server(int fd);
         ~server();
 
         void start_listening();
-
-        std::vector<std::string> process_incoming();
-        void broadcast(const std::string& message);
+        /**
+         * @brief Take over other's listening socket, keeping this server's transports and clients. For when shared
+         * memory or udp were attached before there was a socket to listen on. Call it before start_thread().
+         * 
+         * @param other Left without a socket.
+         */
+        void take_listener(server& other);
+
+        /**
+         * @brief Move accept, recv and send onto a background thread. broadcast() then only copies the message
+         * into a queue of queue_depth slots (dropping it when the queue is full), and process_incoming() only
+         * collects what the thread has already recieved. broadcast(), set_format() and process_incoming()
+         * should all be called from the same thread.
+         * 
+         * @param queue_depth 
+         */
+        void start_thread(size_t queue_depth = 16);
+        void stop_thread();
+
+        /**
+         * @brief Commands recieved since the last call, plus an empty message for every client that disconnected,
+         * in the order they happened.
+         * 
+         * @return std::vector<message> 
+         */
+        std::vector<message> process_incoming();
+        /**
+         * @brief Same as above, but without copying when there is no I/O thread: on_message gets views into
+         * the client's buffer, which are only valid during the call.
+         * 
+         * @tparam F void(int fd, std::string_view data)
+         * @param on_message 
+         */
+        template<typename F>
+        void process_incoming(F on_message);
+        /**
+         * @brief Send a message to every client that uses the given format and is in the given subscription group.
+         * Shared memory and udp are only sent group 0.
+         * 
+         * @param message 
+         * @param f 
+         * @param group 
+         */
+        void broadcast(const std::string& message, format f = format::json, unsigned int group = 0);
+
+        /**
+         * @brief Change the format that is sent to a client.
+         * 
+         * @param fd 
+         * @param f 
+         */
+        void set_format(int fd, format f);
+        /**
+         * @brief Change what happens when a client falls behind.
+         * 
+         * @param fd 
+         * @param policy 
+         */
+        void set_policy(int fd, drop_policy policy);
+        /**
+         * @brief Move a client to a subscription group, so it is only sent what is broadcast to that group.
+         * Clients start in group 0. Shared memory always stays in group 0.
+         * 
+         * @param fd 
+         * @param group Less than max_groups.
+         */
+        void set_group(int fd, unsigned int group);
+        /**
+         * @brief Queue depth and drop count of every client. With the I/O thread running these are
+         * collected by the thread, so they are as of the previous call.
+         * 
+         * @return std::vector<client_stats> 
+         */
+        std::vector<client_stats> stats();
+        /**
+         * @brief Number of connected clients that use the given format.
+         * 
+         * @param f 
+         * @return size_t 
+         */
+        size_t count(format f) const;
+        /**
+         * @brief Number of connected clients in a subscription group that use the given format.
+         * 
+         * @param f 
+         * @param group 
+         * @return size_t 
+         */
+        size_t count(format f, unsigned int group) const;
+
+        /**
+         * @brief Also publish messages to a shared memory ring at /dev/shm/name, for readers on the same machine
+         * (see shm_reader). Shared memory counts as one client (fd shared_memory_fd) once any reader attaches.
+         * 
+         * @param name Must start with '/'.
+         * @param capacity Bytes in the frame ring.
+         * @param f Format to publish.
+         */
+        void attach_shared_memory(const char * name, size_t capacity = 1 << 22, format f = format::json);
+        /**
+         * @brief Serve a socket that is already connected (e.g. one end of a socketpair) like an accepted client.
+         * Call it before start_thread().
+         * 
+         * @param fd 
+         */
+        void add_client(int fd);
+        /**
+         * @brief Also send messages of format f over udp to address:port (see udp_sender, udp_receiver). Call again
+         * to add more destinations, with the same f. Udp counts as one client of format f. Commands still come
+         * over the socket.
+         * 
+         * @param address dotted ipv4, unicast or multicast
+         * @param port 
+         * @param f 
+         * @param interface Address of the interface to send multicast from, or nullptr for the default route.
+         */
+        void attach_udp(const char * address, int port, format f = format::json, const char * interface = nullptr);
 
         int& fd();
 
-        std::vector<pollfd> pollfds;
-
+        int epoll_fd = -1;
+        int spare_fd = -1; // Kept open to be closed when out of fds, see _accept().
+        std::vector<epoll_event> events;
+        std::unordered_map<int, client> clients;
+        std::vector<int> dead_clients;
+        std::atomic<size_t> n_clients[2] = { 0, 0 };
+        static constexpr unsigned int max_groups = 64;
+        std::atomic<size_t> n_group_clients[max_groups][2] = {};
+
+        // I/O thread state.
+        struct outgoing {
+            std::string data;
+            format f;
+            unsigned int group;
+        };
+        std::atomic<bool> running = false;
+        int wake_fd = -1;
+        std::vector<outgoing> outbox;
+        std::atomic<size_t> outbox_head = 0;
+        std::atomic<size_t> outbox_tail = 0;
+        std::mutex inbox_lock;
+        std::vector<message> inbox;
+        std::vector<message> taken; // Swapped with inbox, so both keep their capacity.
+        std::vector<int> half_closed; // From the I/O thread: clients that shut down their side.
+        std::vector<int> close_requests; // To the I/O thread.
+        // Clients that shut down their side during the last process_incoming(). Their commands have been handled
+        // since, so they are closed on the next one, after the replies.
+        std::vector<int> closing;
+        std::vector<std::pair<int, format>> format_changes;
+        std::vector<std::pair<int, drop_policy>> policy_changes;
+        std::vector<std::pair<int, unsigned int>> group_changes;
+        std::vector<client_stats> published_stats;
+        std::atomic<bool> stats_requested = false;
+
+        std::unique_ptr<shm_writer> shared_memory;
+        std::unique_ptr<udp_sender> udp;
+
+        // Only touched by whichever thread does the sending.
+        std::vector<std::unique_ptr<frame>> frames;
+        std::vector<frame*> free_frames;
+        std::vector<int> eof_clients; // Half closed during this _poll().
+
+        template<typename F>
+        void _poll(int timeout, F on_message);
+        void _accept();
+        void _watch_listener();
+        template<typename F>
+        void _read(client& c, F on_message);
+        void _kill(client& c);
+        void _close_when_flushed(int fd);
+        void _want_write(client& c, bool want);
+        frame * _acquire();
+        void _release(frame * fr);
+        void _count(format f, unsigned int group, int delta);
+        void _send(frame * fr, format f, unsigned int group);
+        void _enqueue(client& c, frame * fr);
+        void _flush(client& c);
+        void _apply_format(int fd, format f);
+        void _apply_policy(int fd, drop_policy policy);
+        void _apply_group(int fd, unsigned int group);
+        void _collect_stats(std::vector<client_stats>& out);
+        void _wake();
+        void _run();
     };
     std::unordered_map<int, std::unique_ptr<net::socket>> connections;
 
@@ -98,9 +714,38 @@ int& net::server::fd() {
 
 
 net::server::server(int _fd) : _socket(_fd) {
-    pollfds.resize(1);
-    pollfds[0].fd = _fd;
-    pollfds[0].events = POLLIN;
+    epoll_fd = epoll_create1(0);
+    if(epoll_fd < 0) {
+        throw std::runtime_error("Couldn't create epoll");
+    }
+    events.resize(256);
+    // Shared memory only.
+    if(_fd < 0) return;
+
+    _watch_listener();
+}
+
+void net::server::_watch_listener() {
+    // Edge-triggered: _accept() keeps accepting until EAGAIN.
+    fcntl(fd(), F_SETFL, fcntl(fd(), F_GETFL) | O_NONBLOCK);
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = fd();
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd(), &event);
+    if(spare_fd < 0) spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+void net::server::take_listener(server& other) {
+    if(fd() >= 0) {
+        throw std::runtime_error("Server is already listening");
+    }
+    if(thread != nullptr) {
+        throw std::runtime_error("Can't take a listener with the I/O thread running");
+    }
+    fd() = other.fd();
+    other.fd() = -1;
+    epoll_ctl(other.epoll_fd, EPOLL_CTL_DEL, fd(), nullptr);
+    _watch_listener();
 }
 
 net::socket::socket(int _fd) : fd(_fd) {
@@ -108,7 +753,10 @@ net::socket::socket(int _fd) : fd(_fd) {
 }
 
 net::server::~server() {
-
+    stop_thread();
+    for(auto& [fd, c] : clients) close(fd);
+    if(spare_fd >= 0) close(spare_fd);
+    close(epoll_fd);
 }
 
 void net::server::start_listening() {
@@ -118,79 +766,1042 @@ void net::server::start_listening() {
     }
 }
 
-void net::server::broadcast(const std::string& s) {
-    for(size_t i = 1; i < pollfds.size(); i ++) {
-        if(!chk_bit(pollfds[i].fd, POLLHUP)){
-            write(pollfds[i].fd, &s[0], s.size());
+void net::server::start_thread(size_t queue_depth) {
+    if(thread != nullptr) return;
+
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if(wake_fd < 0) {
+        throw std::runtime_error("Couldn't create eventfd");
+    }
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+
+    outbox.resize(queue_depth);
+    running = true;
+    thread = new std::thread(&net::server::_run, this);
+}
+
+void net::server::stop_thread() {
+    if(thread == nullptr) return;
+
+    running = false;
+    _wake();
+    thread->join();
+    delete thread;
+    thread = nullptr;
+
+    close(wake_fd);
+    wake_fd = -1;
+}
+
+void net::server::_wake() {
+    uint64_t one = 1;
+    ::write(wake_fd, &one, sizeof(one));
+}
+
+void net::server::_run() {
+    std::vector<message> received;
+    std::vector<std::pair<int, format>> changes;
+    std::vector<std::pair<int, drop_policy>> policies;
+    std::vector<std::pair<int, unsigned int>> groups;
+    std::vector<client_stats> current_stats;
+    std::vector<int> closes;
+    while(running) {
+        // Copied, since they are handled on the other thread after the framer has moved on.
+        _poll(-1, [&](int fd, std::string_view data) { received.push_back({ fd, std::string(data) }); });
+        bool collect = stats_requested.exchange(false);
+        if(collect) _collect_stats(current_stats);
+
+        {
+            std::lock_guard<std::mutex> lock(inbox_lock);
+            for(auto& message : received) inbox.push_back(std::move(message));
+            half_closed.insert(half_closed.end(), eof_clients.begin(), eof_clients.end());
+            closes.swap(close_requests);
+            changes.swap(format_changes);
+            policies.swap(policy_changes);
+            groups.swap(group_changes);
+            if(collect) published_stats.swap(current_stats);
+        }
+        received.clear();
+        eof_clients.clear();
+
+        // Apply format changes before sending anything queued after them.
+        for(auto& [fd, f] : changes) _apply_format(fd, f);
+        changes.clear();
+        for(auto& [fd, policy] : policies) _apply_policy(fd, policy);
+        policies.clear();
+        for(auto& [fd, group] : groups) _apply_group(fd, group);
+        groups.clear();
+
+        size_t head = outbox_head.load(std::memory_order_relaxed);
+        while(head != outbox_tail.load(std::memory_order_acquire)) {
+            outgoing& slot = outbox[head % outbox.size()];
+            // Swap buffers instead of copying. Both keep their capacity, so this doesn't allocate.
+            frame * fr = _acquire();
+            fr->data.swap(slot.data);
+            _send(fr, slot.f, slot.group);
+            head ++;
+            outbox_head.store(head, std::memory_order_release);
         }
+
+        // After sending, since the replies were queued before the request.
+        for(int fd : closes) _close_when_flushed(fd);
+        closes.clear();
     }
 }
 
-std::vector<std::string> net::server::process_incoming() {
-    std::vector<std::string> out;
+void net::server::broadcast(const std::string& s, format f, unsigned int group) {
+    if(group == 0 && shared_memory && shared_memory->f == f) shared_memory->publish(s);
+    if(group == 0 && udp && udp->f == f) udp->publish(s);
+
+    if(thread == nullptr) {
+        frame * fr = _acquire();
+        fr->data.assign(s);
+        _send(fr, f, group);
+        return;
+    }
 
-    int& server_fd = fd();
+    size_t tail = outbox_tail.load(std::memory_order_relaxed);
+    if(tail - outbox_head.load(std::memory_order_acquire) >= outbox.size()) {
+        n_dropped ++;
+        return;
+    }
+    outgoing& slot = outbox[tail % outbox.size()];
+    slot.data.assign(s);
+    slot.f = f;
+    slot.group = group;
+    outbox_tail.store(tail + 1, std::memory_order_release);
+    _wake();
+}
 
-    int n_ready = poll(&pollfds[0], pollfds.size(), 0);
+net::frame * net::server::_acquire() {
+    if(free_frames.empty()) {
+        frames.push_back(std::make_unique<frame>());
+        return frames.back().get();
+    }
+    frame * fr = free_frames.back();
+    free_frames.pop_back();
+    return fr;
+}
+
+void net::server::_release(frame * fr) {
+    if(fr->refs > 0) fr->refs --;
+    if(fr->refs == 0) free_frames.push_back(fr);
+}
+
+void net::server::_count(format f, unsigned int group, int delta) {
+    n_clients[(int) f] += delta;
+    n_group_clients[group][(int) f] += delta;
+}
+
+void net::server::_send(frame * fr, format f, unsigned int group) {
+    // Every client queues the same frame. Hold a reference until the loop is done so it isn't recycled early.
+    fr->refs ++;
+    for(auto& [fd, c] : clients) {
+        if(c.f != f || c.group != group || c.dead) continue;
+        _enqueue(c, fr);
+        // Clients that are already behind get flushed on EPOLLOUT.
+        if(!c.want_write) _flush(c);
+    }
+    _release(fr);
+}
+
+void net::server::_enqueue(client& c, frame * fr) {
+    // The front message may be half sent, so it can't be dropped without corrupting the stream.
+    size_t droppable = c.offset > 0 ? c.queue.size() - 1 : c.queue.size();
+    if(c.queue.size() >= c.max_queue && droppable > 0) {
+        size_t oldest = c.queue.size() - droppable;
+        switch(c.policy) {
+            case drop_policy::drop_oldest:
+                _release(c.queue[oldest]);
+                c.queue.erase(oldest);
+                c.n_dropped ++;
+                n_client_drops ++;
+                break;
+            case drop_policy::latest_only:
+                for(size_t i = oldest; i < c.queue.size(); i ++) _release(c.queue[i]);
+                c.queue.pop_back(droppable);
+                c.n_dropped += droppable;
+                n_client_drops += droppable;
+                break;
+            case drop_policy::disconnect:
+                _kill(c);
+                n_client_drops ++;
+                return;
+        }
+    }
+    fr->refs ++;
+    c.queue.push_back(fr);
+}
+
+void net::server::_flush(client& c) {
+    while(!c.queue.empty() && !c.dead) {
+        // Hand as many queued frames as possible to the kernel in one call.
+        iovec iov[64];
+        size_t n_iov = 0;
+        for(; n_iov < c.queue.size() && n_iov < 64; n_iov ++) {
+            size_t skip = n_iov == 0 ? c.offset : 0;
+            iov[n_iov].iov_base = c.queue[n_iov]->data.data() + skip;
+            iov[n_iov].iov_len = c.queue[n_iov]->data.size() - skip;
+        }
+        ssize_t n;
+        if(n_iov == 1) {
+            // The usual case when keeping up. send() is cheaper than sendmsg() for one buffer.
+            n = ::send(c.fd, iov[0].iov_base, iov[0].iov_len, MSG_NOSIGNAL);
+        }else {
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = n_iov;
+            n = ::sendmsg(c.fd, &msg, MSG_NOSIGNAL);
+        }
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                _want_write(c, true); // Picked up again on EPOLLOUT.
+                return;
+            }
+            if(errno == EINTR) continue;
+            _kill(c);
+            return;
+        }
+        n_bytes_sent.fetch_add(n, std::memory_order_relaxed);
+        size_t sent = n;
+        while(sent > 0) {
+            size_t left = c.queue.front()->data.size() - c.offset;
+            if(sent < left) {
+                c.offset += sent;
+                break;
+            }
+            sent -= left;
+            _release(c.queue.front());
+            c.queue.pop_front();
+            c.offset = 0;
+        }
+    }
+    if(c.queue.empty()) {
+        _want_write(c, false);
+        if(c.closing) _kill(c);
+    }
+}
+
+void net::server::_want_write(client& c, bool want) {
+    if(c.want_write == want || c.dead) return;
+    c.want_write = want;
+
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (want ? (uint32_t) EPOLLOUT : (uint32_t) 0);
+    event.data.fd = c.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &event);
+}
+
+void net::server::set_format(int fd, format f) {
+    if(fd == shared_memory_fd) {
+        if(!shared_memory || shared_memory->f == f) return;
+        if(shared_memory->live) {
+            _count(shared_memory->f, 0, -1);
+            _count(f, 0, 1);
+        }
+        shared_memory->set_format(f);
+        n_format_changes ++;
+        return;
+    }
+    if(thread == nullptr) {
+        _apply_format(fd, f);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(inbox_lock);
+        format_changes.emplace_back(fd, f);
+    }
+    _wake();
+}
+
+void net::server::_apply_format(int fd, format f) {
+    auto i = clients.find(fd);
+    if(i == clients.end()) return;
+    _count(i->second.f, i->second.group, -1);
+    _count(f, i->second.group, 1);
+    i->second.f = f;
+    n_format_changes ++;
+}
+
+void net::server::set_policy(int fd, drop_policy policy) {
+    if(thread == nullptr) {
+        _apply_policy(fd, policy);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(inbox_lock);
+        policy_changes.emplace_back(fd, policy);
+    }
+    _wake();
+}
+
+void net::server::_apply_policy(int fd, drop_policy policy) {
+    auto i = clients.find(fd);
+    if(i != clients.end()) i->second.policy = policy;
+}
+
+void net::server::set_group(int fd, unsigned int group) {
+    if(fd == shared_memory_fd || group >= max_groups) return;
+    if(thread == nullptr) {
+        _apply_group(fd, group);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(inbox_lock);
+        group_changes.emplace_back(fd, group);
+    }
+    _wake();
+}
+
+void net::server::_apply_group(int fd, unsigned int group) {
+    auto i = clients.find(fd);
+    if(i == clients.end() || i->second.group == group) return;
+    _count(i->second.f, i->second.group, -1);
+    _count(i->second.f, group, 1);
+    i->second.group = group;
+    n_group_changes ++;
+}
+
+std::vector<net::client_stats> net::server::stats() {
+    std::vector<client_stats> out;
+    if(thread == nullptr) {
+        _collect_stats(out);
+    }else {
+        std::lock_guard<std::mutex> lock(inbox_lock);
+        out = published_stats;
+        stats_requested = true;
+    }
+    return out;
+}
+
+void net::server::_collect_stats(std::vector<client_stats>& out) {
+    out.clear();
+    for(auto& [fd, c] : clients) {
+        out.push_back({ fd, c.f, c.queue.size(), c.n_dropped });
+    }
+}
+
+size_t net::server::count(format f) const {
+    return n_clients[(int) f];
+}
+
+size_t net::server::count(format f, unsigned int group) const {
+    return group < max_groups ? n_group_clients[group][(int) f].load() : 0;
+}
+
+std::vector<net::message> net::server::process_incoming() {
+    std::vector<message> out;
+    process_incoming([&](int fd, std::string_view data) { out.push_back({ fd, std::string(data) }); });
+    return out;
+}
+
+template<typename F>
+void net::server::process_incoming(F on_message) {
+    // A peer that shut down its side still gets the replies to what it sent. Those were queued by the tick
+    // after its commands were handled, so now it can be closed once they are sent.
+    if(thread == nullptr) {
+        for(int fd : closing) _close_when_flushed(fd);
+        closing.clear();
+        _poll(0, on_message);
+        closing.swap(eof_clients);
+    }else {
+        // Never wait on the I/O thread. Anything missed is picked up next time.
+        bool requested = false;
+        {
+            std::unique_lock<std::mutex> lock(inbox_lock, std::try_to_lock);
+            if(lock.owns_lock()) {
+                taken.swap(inbox);
+                close_requests.insert(close_requests.end(), closing.begin(), closing.end());
+                requested = !closing.empty();
+                closing.clear();
+                closing.swap(half_closed);
+            }
+        }
+        if(requested) _wake();
+        for(auto& message : taken) on_message(message.fd, std::string_view(message.data));
+        taken.clear();
+    }
+
+    if(shared_memory) {
+        // A new reader needs a keyframe, same as a new connection.
+        uint64_t n_detached = shared_memory->region.header->n_detached.load(std::memory_order_acquire);
+        uint64_t n_attached = shared_memory->region.header->n_attached.load(std::memory_order_acquire);
+        if(n_attached != shared_memory->n_attached_seen) {
+            n_accepted += n_attached - shared_memory->n_attached_seen;
+            shared_memory->n_attached_seen = n_attached;
+        }
+        // Every attached reader counts as one client until the last one detaches.
+        bool live = n_attached > n_detached;
+        if(live != shared_memory->live) {
+            _count(shared_memory->f, 0, live ? 1 : -1);
+            shared_memory->live = live;
+        }
+        shared_memory->receive(taken);
+        for(auto& message : taken) on_message(message.fd, std::string_view(message.data));
+        taken.clear();
+    }
+}
+
+void net::server::attach_shared_memory(const char * name, size_t capacity, format f) {
+    if(shared_memory && shared_memory->live) _count(shared_memory->f, 0, -1);
+    shared_memory = std::make_unique<shm_writer>(name, capacity, 64, f);
+}
+
+void net::server::attach_udp(const char * address, int port, format f, const char * interface) {
+    if(udp && udp->f != f) {
+        throw std::runtime_error("Udp is already sending another format");
+    }
+    if(!udp) {
+        udp = std::make_unique<udp_sender>(f, interface);
+        _count(f, 0, 1);
+        n_accepted ++;
+    }
+    udp->add_destination(address, port);
+}
+
+static in_addr _parse_ipv4(const char * address) {
+    in_addr addr;
+    if(inet_pton(AF_INET, address, &addr) != 1) {
+        throw std::runtime_error("Couldn't parse address");
+    }
+    return addr;
+}
+
+net::udp_sender::udp_sender(format _f, const char * interface, size_t mtu, int ttl) : f(_f) {
+    // ip (20) and udp (8) headers.
+    max_payload = mtu - 28 - sizeof(udp_header);
+    fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if(fd < 0) {
+        throw std::runtime_error("Couldn't create a socket");
+    }
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    if(interface != nullptr) {
+        in_addr addr = _parse_ipv4(interface);
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &addr, sizeof(addr));
+    }
+}
+
+net::udp_sender::~udp_sender() {
+    if(fd != -1) ::close(fd);
+}
+
+void net::udp_sender::add_destination(const char * address, int port) {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = _parse_ipv4(address);
+    destinations.push_back(addr);
+}
+
+void net::udp_sender::publish(const std::string& data) {
+    size_t n_fragments = std::max<size_t>(1, (data.size() + max_payload - 1) / max_payload);
+    if(n_fragments > UINT16_MAX + 1) {
+        n_errors ++;
+        return;
+    }
+    size_t n = n_fragments * destinations.size();
+    headers.resize(n_fragments);
+    iovecs.resize(n_fragments * 2);
+    messages.resize(n);
+
+    for(size_t i = 0; i < n_fragments; i ++) {
+        size_t offset = i * max_payload;
+        udp_header& h = headers[i];
+        h.sequence = htole32(sequence);
+        h.length = htole32(data.size());
+        h.offset = htole32(offset);
+        h.f = (uint8_t) f;
+        h.reserved = 0;
+        h.fragment = htole16(i);
+        iovecs[i * 2] = { &h, sizeof(h) };
+        iovecs[i * 2 + 1] = { const_cast<char *>(data.data()) + offset, std::min(max_payload, data.size() - offset) };
+    }
+    // Every fragment to every destination, in one syscall.
+    for(size_t d = 0; d < destinations.size(); d ++) {
+        for(size_t i = 0; i < n_fragments; i ++) {
+            msghdr& m = messages[d * n_fragments + i].msg_hdr;
+            memset(&m, 0, sizeof(m));
+            m.msg_name = &destinations[d];
+            m.msg_namelen = sizeof(sockaddr_in);
+            m.msg_iov = &iovecs[i * 2];
+            m.msg_iovlen = 2;
+        }
+    }
+    sequence ++;
+
+    size_t sent = 0;
+    while(sent < n) {
+        int result = sendmmsg(fd, &messages[sent], n - sent, 0);
+        if(result < 0) {
+            if(errno == EINTR) continue;
+            // Full socket buffer or unreachable destination. Skip that datagram rather than stall telemetry on it.
+            n_errors ++;
+            sent ++;
+            continue;
+        }
+        sent += result;
+    }
+}
+
+net::udp_receiver::udp_receiver(int port, const char * group, const char * interface) : datagram(1 << 16) {
+    fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if(fd < 0) {
+        throw std::runtime_error("Couldn't create a socket");
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if(::bind(fd, (sockaddr *) &addr, sizeof(addr)) < 0) {
+        ::close(fd);
+        throw std::runtime_error("Couldn't bind");
+    }
+
+    if(group != nullptr) {
+        ip_mreq membership;
+        memset(&membership, 0, sizeof(membership));
+        membership.imr_interface.s_addr = INADDR_ANY;
+        if(interface != nullptr && inet_pton(AF_INET, interface, &membership.imr_interface) != 1) {
+            ::close(fd);
+            throw std::runtime_error("Couldn't parse address");
+        }
+        if(inet_pton(AF_INET, group, &membership.imr_multiaddr) != 1
+            || setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+            ::close(fd);
+            throw std::runtime_error("Couldn't join multicast group");
+        }
+    }
+}
+
+net::udp_receiver::~udp_receiver() {
+    if(fd != -1) ::close(fd);
+}
+
+bool net::udp_receiver::next(std::string_view& frame, format& f) {
+    while(true) {
+        ssize_t n = recv(fd, datagram.data(), datagram.size(), 0);
+        if(n < 0) return false;
+        if((size_t) n < sizeof(udp_header)) continue;
+
+        udp_header h;
+        memcpy(&h, datagram.data(), sizeof(h));
+        uint32_t sequence = le32toh(h.sequence);
+        uint32_t length = le32toh(h.length);
+        uint32_t offset = le32toh(h.offset);
+        uint16_t fragment = le16toh(h.fragment);
+        size_t payload = n - sizeof(udp_header);
+        if((size_t) offset + payload > length) continue;
+
+        if(!started || (int32_t) (sequence - expected) >= 0) {
+            // A new frame. Whatever was still being put together won't be finished.
+            if(started) {
+                if(received > 0) n_incomplete ++;
+                n_lost += sequence - expected;
+            }
+            started = true;
+            assembling = sequence;
+            received = 0;
+            fragments.assign(fragment + 1, false);
+            buffer.resize(length);
+            expected = sequence + 1;
+        }else if(sequence != assembling || received == 0) {
+            // Late fragment of a frame that was already given up on (or finished).
+            continue;
+        }
+        if(fragment >= fragments.size()) fragments.resize(fragment + 1, false);
+        // Duplicated by the network.
+        if(fragments[fragment]) continue;
+        fragments[fragment] = true;
+
+        memcpy(buffer.data() + offset, datagram.data() + sizeof(udp_header), payload);
+        received += payload;
+        if(received >= length) {
+            received = 0;
+            frame = std::string_view(buffer.data(), length);
+            f = (format) h.f;
+            return true;
+        }
+    }
+}
+
+net::shm_region::~shm_region() {
+    if(header != nullptr) munmap(header, size);
+    if(owner) shm_unlink(name.c_str());
+}
+
+void net::shm_region::create(const char * _name, size_t capacity, size_t n_command_slots) {
+    name = _name;
+    capacity = std::bit_ceil(std::max<size_t>(capacity, 4096));
+    n_command_slots = std::bit_ceil(std::max<size_t>(n_command_slots, 1));
+    size = sizeof(shm_header) + capacity + n_command_slots * sizeof(shm_command);
+
+    shm_unlink(_name);
+    int fd = shm_open(_name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0) {
+        throw std::runtime_error("Couldn't create shared memory");
+    }
+    if(ftruncate(fd, size) < 0) {
+        ::close(fd);
+        shm_unlink(_name);
+        throw std::runtime_error("Couldn't size shared memory");
+    }
+    void * mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if(mapped == MAP_FAILED) {
+        shm_unlink(_name);
+        throw std::runtime_error("Couldn't map shared memory");
+    }
+    owner = true;
+
+    // The file starts out zeroed, which is a valid empty state for all of the counters.
+    header = static_cast<shm_header *>(mapped);
+    header->capacity = capacity;
+    header->n_command_slots = n_command_slots;
+    for(size_t i = 0; i < n_command_slots; i ++) commands()[i].sequence.store(i, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::atomic_ref<uint32_t>(header->magic).store(shm_header::magic_value, std::memory_order_release);
+}
+
+void net::shm_region::open(const char * _name) {
+    name = _name;
+    int fd = shm_open(_name, O_RDWR, 0);
+    if(fd < 0) {
+        throw std::runtime_error("Couldn't open shared memory");
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(shm_header)) {
+        ::close(fd);
+        throw std::runtime_error("Couldn't open shared memory");
+    }
+    size = st.st_size;
+    void * mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(mapped == MAP_FAILED) {
+        throw std::runtime_error("Couldn't map shared memory");
+    }
+    header = static_cast<shm_header *>(mapped);
+    if(std::atomic_ref<uint32_t>(header->magic).load(std::memory_order_acquire) != shm_header::magic_value) {
+        throw std::runtime_error("Not a mission control shared memory transport");
+    }
+}
+
+net::shm_writer::shm_writer(const char * name, size_t capacity, size_t n_command_slots, format _f) : f(_f) {
+    region.create(name, capacity, n_command_slots);
+    region.header->f.store((uint32_t) f, std::memory_order_relaxed);
+}
+
+static void _futex_wake(std::atomic<uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+void net::shm_writer::publish(const std::string& data) {
+    shm_header& h = *region.header;
+    size_t mask = h.capacity - 1;
+    size_t need = (8 + data.size() + 7) & ~(size_t) 7;
+    if(need > h.capacity / 2) {
+        n_dropped ++;
+        return;
+    }
+
+    uint64_t position = h.written.load(std::memory_order_relaxed);
+    size_t offset = position & mask;
+    bool wraps = offset + need > h.capacity;
+    uint64_t start = wraps ? position + (h.capacity - offset) : position;
+
+    // Tell readers which bytes are about to be overwritten before touching them.
+    h.reserved.store(start + need, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if(wraps) {
+        std::memcpy(region.ring() + offset, &shm_header::wrap, 4);
+        offset = 0;
+    }
+    uint32_t length = data.size();
+    uint32_t frame_format = (uint32_t) f;
+    std::memcpy(region.ring() + offset, &length, 4);
+    std::memcpy(region.ring() + offset + 4, &frame_format, 4);
+    std::memcpy(region.ring() + offset + 8, data.data(), data.size());
+
+    h.last.store(start, std::memory_order_relaxed);
+    h.written.store(start + need, std::memory_order_release);
+    h.futex.fetch_add(1, std::memory_order_release);
+    if(h.n_waiting.load(std::memory_order_seq_cst) > 0) _futex_wake(h.futex);
+}
+
+void net::shm_writer::receive(std::vector<message>& out) {
+    shm_header& h = *region.header;
+    size_t mask = h.n_command_slots - 1;
+    while(true) {
+        shm_command& slot = region.commands()[h.command_pop & mask];
+        if(slot.sequence.load(std::memory_order_acquire) != h.command_pop + 1) break;
+        message m;
+        m.fd = shared_memory_fd;
+        m.data.assign(slot.data, std::min<size_t>(slot.length, shm_header::command_size));
+        if(m.data.empty() || m.data.back() != ';') m.data += ';';
+        out.push_back(std::move(m));
+        slot.sequence.store(h.command_pop + h.n_command_slots, std::memory_order_release);
+        h.command_pop ++;
+    }
+}
+
+void net::shm_writer::set_format(format _f) {
+    f = _f;
+    region.header->f.store((uint32_t) f, std::memory_order_relaxed);
+}
+
+net::shm_reader::shm_reader(const char * name) {
+    region.open(name);
+    position = region.header->written.load(std::memory_order_acquire);
+    region.header->n_attached.fetch_add(1, std::memory_order_release);
+}
+
+net::shm_reader::~shm_reader() {
+    if(region.header != nullptr) region.header->n_detached.fetch_add(1, std::memory_order_release);
+}
+
+bool net::shm_reader::next(std::string_view& frame, format& f) {
+    shm_header& h = *region.header;
+    size_t mask = h.capacity - 1;
+    while(true) {
+        uint64_t written = h.written.load(std::memory_order_acquire);
+        if(position == written) return false;
+        if(written - position > h.capacity) {
+            // Fell behind by a whole ring, skip to the newest frame.
+            position = h.last.load(std::memory_order_acquire);
+            n_skipped ++;
+            continue;
+        }
+
+        size_t offset = position & mask;
+        uint32_t length;
+        std::memcpy(&length, region.ring() + offset, 4);
+        if(length == shm_header::wrap) {
+            position += h.capacity - offset;
+            continue;
+        }
+        uint32_t frame_format;
+        std::memcpy(&frame_format, region.ring() + offset + 4, 4);
+
+        current = position;
+        if(!intact() || length > h.capacity) {
+            position = h.last.load(std::memory_order_acquire);
+            n_skipped ++;
+            continue;
+        }
+        frame = std::string_view(region.ring() + offset + 8, length);
+        f = (format) frame_format;
+        position += (8 + length + 7) & ~(size_t) 7;
+        return true;
+    }
+}
+
+bool net::shm_reader::intact() const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return region.header->reserved.load(std::memory_order_relaxed) - current <= region.header->capacity;
+}
+
+bool net::shm_reader::wait(int timeout_ms) {
+    shm_header& h = *region.header;
+    uint32_t seen = h.futex.load(std::memory_order_acquire);
+    if(h.written.load(std::memory_order_acquire) != position) return true;
+
+    timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000l;
+    h.n_waiting.fetch_add(1, std::memory_order_seq_cst);
+    // Returns straight away if a frame was published since seen was read.
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&h.futex), FUTEX_WAIT, seen, timeout_ms < 0 ? nullptr : &timeout, nullptr, 0);
+    h.n_waiting.fetch_sub(1, std::memory_order_relaxed);
+    return h.written.load(std::memory_order_acquire) != position;
+}
+
+bool net::shm_reader::send(std::string_view commands) {
+    shm_header& h = *region.header;
+    if(commands.size() > shm_header::command_size) return false;
+    size_t mask = h.n_command_slots - 1;
+    uint64_t position = h.command_push.load(std::memory_order_relaxed);
+    while(true) {
+        shm_command& slot = region.commands()[position & mask];
+        uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if(sequence == position) {
+            if(h.command_push.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                slot.length = commands.size();
+                std::memcpy(slot.data, commands.data(), commands.size());
+                slot.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        }else if(sequence < position + 1) {
+            return false;
+        }else {
+            position = h.command_push.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template<typename F>
+void net::server::_poll(int timeout, F on_message) {
+    int n_ready = epoll_wait(epoll_fd, &events[0], events.size(), timeout);
     if(n_ready < 0) {
+        if(errno == EINTR) return;
         throw std::runtime_error("Polling failed");
     }
 
-    if(chk_bit(pollfds[0].revents, POLLIN)) {
-        int client_fd = accept(server_fd, NULL, NULL);
-        if(client_fd < 0) {
-            throw std::runtime_error("Accept failed");
+    for(int i = 0; i < n_ready; i ++) {
+        int fd = events[i].data.fd;
+        uint32_t flags = events[i].events;
+
+        if(fd == this->fd()) {
+            _accept();
+            continue;
+        }
+        if(fd == wake_fd) {
+            uint64_t n;
+            ::read(wake_fd, &n, sizeof(n));
+            continue;
         }
 
-        pollfd _pollfd;
-        _pollfd.fd = client_fd;
-        _pollfd.events = POLLIN;
-        
-        pollfds.push_back(_pollfd);
-        printf("client connected: %d\n", client_fd);
+        auto c = clients.find(fd);
+        if(c == clients.end()) continue;
 
-        // std::unique_ptr<net::socket> client = std::make_unique<net::socket>(client_fd);
+        if(chk_bit(flags, EPOLLOUT)) _flush(c->second);
+        // Read before handling hang ups, so nothing sent right before closing is lost. EPOLLRDHUP only means the
+        // peer won't send any more: _read() sees the end of the stream, and the client is closed after the replies.
+        if((flags & (EPOLLIN | EPOLLRDHUP)) != 0) _read(c->second, on_message);
+        if((flags & (EPOLLHUP | EPOLLERR)) != 0) _kill(c->second);
+    }
 
-        // connections[client_fd] = std::move(client);
+    // Clients that hung up, failed a send or were disconnected by their drop policy.
+    if(!dead_clients.empty()) {
+        for(int fd : dead_clients) {
+            auto c = clients.find(fd);
+            if(c == clients.end()) continue;
+            close(fd);
+            _count(c->second.f, c->second.group, -1);
+            for(size_t i = 0; i < c->second.queue.size(); i ++) _release(c->second.queue[i]);
+            clients.erase(c);
+            on_message(fd, std::string_view());
+        }
+        if(thread != nullptr) {
+            // Changes still queued for these fds were meant for the closed clients, not whoever gets the fd next.
+            std::lock_guard<std::mutex> lock(inbox_lock);
+            for(int fd : dead_clients) {
+                std::erase_if(format_changes, [fd](const auto& change) { return change.first == fd; });
+                std::erase_if(policy_changes, [fd](const auto& change) { return change.first == fd; });
+                std::erase_if(group_changes, [fd](const auto& change) { return change.first == fd; });
+            }
+        }
+        dead_clients.clear();
     }
 
-    size_t n_closed_fds = 0;
-    for(size_t i = 1; i < pollfds.size(); i ++) {
-        if(chk_bit(pollfds[i].revents, POLLNVAL)) n_closed_fds++;
-        else if(chk_bit(pollfds[i].revents, POLLHUP)) {
-            n_closed_fds++;
-        }else if(chk_bit(pollfds[i].revents, POLLIN)) {
-            int fd = pollfds[i].fd;
-            printf("Reading from %d\n", fd);
+    // Every slot was used, so there might be more waiting.
+    if((size_t) n_ready == events.size()) events.resize(events.size() * 2);
+}
 
-            // std::unique_ptr<net::socket>& client = connections[fd];
+void net::server::_accept() {
+    while(true) {
+        int client_fd = accept4(fd(), NULL, NULL, SOCK_NONBLOCK);
+        if(client_fd < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            if(errno == EMFILE || errno == ENFILE) {
+                // Out of fds. The listener is edge-triggered, so a connection left in the backlog isn't seen
+                // again until another one arrives. Free the spare fd to accept it, and hang up on it.
+                if(spare_fd < 0) return;
+                close(spare_fd);
+                int refused = accept4(fd(), NULL, NULL, SOCK_NONBLOCK);
+                if(refused >= 0) close(refused);
+                spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if(refused < 0) return;
+                continue;
+            }
+            // Errors of the connection being accepted rather than the listener, see accept(2).
+            if(errno == EPROTO || errno == ENETDOWN || errno == ENOPROTOOPT || errno == EHOSTDOWN || errno == ENONET
+                || errno == EHOSTUNREACH || errno == EOPNOTSUPP || errno == ENETUNREACH) continue;
+            // Not thrown: this may be the I/O thread, with nothing to catch it.
+            perror("accept");
+            return;
+        }
 
-            char buf[4096];
-            size_t n_bytes = recv(fd, buf, 4095, 0);
-            // if(n_bytes == -1) {
-            //     // throw std::runtime_error("Error with recv");
-            // }
-            buf[n_bytes] = '\0';
-            
-            printf("client message: \"%s\"\n", buf);
-            out.emplace_back(buf);
-            // std::string data(buf);
+        if(clients.size() >= max_clients) {
+            close(client_fd);
+            continue;
         }
+
+        add_client(client_fd);
     }
+}
+
+void net::server::add_client(int client_fd) {
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    event.data.fd = client_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+
+    client& c = clients[client_fd];
+    c.fd = client_fd;
+    c.policy = default_policy;
+    c.max_queue = default_max_queue;
+    c.queue.reset(std::max<size_t>(c.max_queue, 1) + 1);
+    _count(format::json, 0, 1);
+    n_accepted ++;
+}
+
+template<typename F>
+void net::server::_read(client& c, F on_message) {
+    if(c.incoming.closed) return; // Nothing more to read.
+
+    // Only whole commands are passed on, each with its delimiter.
+    size_t discarded = c.incoming.n_discarded;
+    bool open = c.incoming.read(c.fd, [&](std::string_view command) { on_message(c.fd, command); });
+    if(c.incoming.n_discarded != discarded) n_bytes_discarded += c.incoming.n_discarded - discarded;
+    if(open) return;
+
+    // Stays open for the replies if the peer only shut down its side, see process_incoming().
+    if(c.incoming.closed) eof_clients.push_back(c.fd);
+    else _kill(c);
+}
+
+void net::server::_close_when_flushed(int fd) {
+    auto i = clients.find(fd);
+    // The fd might belong to a new client by now.
+    if(i == clients.end() || !i->second.incoming.closed) return;
+    i->second.closing = true;
+    if(i->second.queue.empty()) _kill(i->second);
+}
 
+void net::server::_kill(client& c) {
+    if(c.dead) return;
+    c.dead = true;
+    dead_clients.push_back(c.fd);
+}
+
+net::framer::framer(size_t capacity, size_t _max_size) : buffer(capacity), max_size(_max_size) {
 
-    if(n_closed_fds > 0) {
-        printf("Cleaning up dead sockets\n");
-        for(size_t i = pollfds.size() - 1; i >= 1; i --) {
-            if(chk_bit(pollfds[i].revents, POLLNVAL) || chk_bit(pollfds[i].revents, POLLHUP)) {
-                // connections.erase(pollfds[i].fd);
-                close(pollfds[i].fd);
-                pollfds.erase(pollfds.begin() + i);
+}
+
+template<typename F>
+bool net::framer::read(int fd, F on_command) {
+    // Edge-triggered, so read until EAGAIN.
+    while(true) {
+        if(end == buffer.size()) {
+            if(start > 0) {
+                // Move the unfinished command to the front to make room.
+                memmove(&buffer[0], &buffer[start], end - start);
+                scanned -= start;
+                end -= start;
+                start = 0;
+            }else if(buffer.size() < max_size) {
+                buffer.resize(buffer.size() * 2);
+            }else {
+                // One command filled the whole buffer. Throw it away, up to its delimiter.
+                discarding = true;
+                quoted = escaped = false;
+                n_discarded += end;
+                start = scanned = end = 0;
             }
         }
+
+        ssize_t n_bytes = recv(fd, &buffer[end], buffer.size() - end, 0);
+        if(n_bytes < 0) {
+            if(errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if(n_bytes == 0) {
+            closed = true;
+            return false;
+        }
+        end += n_bytes;
+
+        std::string_view command;
+        while(next(command)) on_command(command);
+
+        // Everything was a complete command, so start again from the front.
+        if(start == end) start = scanned = end = 0;
     }
+}
 
-    return out;
+bool net::framer::next(std::string_view& command) {
+    for(; scanned < end; scanned ++) {
+        char c = buffer[scanned];
+        // \" inside quotes is part of the string, as serialize::append writes it.
+        if(escaped) {
+            escaped = false;
+            continue;
+        }
+        if(quoted && c == '\\') {
+            escaped = true;
+            continue;
+        }
+        if(c == '"') quoted = !quoted;
+        if(quoted || (c != ';' && c != '\x1f')) continue;
+
+        size_t command_start = start;
+        start = scanned + 1;
+        if(discarding) {
+            discarding = false;
+            n_discarded += scanned - command_start;
+            continue;
+        }
+        if(scanned == command_start) continue; // Empty command.
+
+        command = std::string_view(&buffer[command_start], scanned + 1 - command_start);
+        scanned ++;
+        return true;
+    }
+    return false;
+}
+
+void net::frame_ring::reset(size_t capacity) {
+    slots.assign(capacity, nullptr);
+    head = n = 0;
+}
+
+size_t net::frame_ring::size() const {
+    return n;
+}
+
+bool net::frame_ring::empty() const {
+    return n == 0;
+}
+
+net::frame *& net::frame_ring::operator[](size_t i) {
+    return slots[(head + i) % slots.size()];
+}
+
+net::frame * net::frame_ring::front() {
+    return slots[head];
+}
+
+void net::frame_ring::push_back(frame * fr) {
+    (*this)[n] = fr;
+    n ++;
+}
+
+void net::frame_ring::pop_front() {
+    head = (head + 1) % slots.size();
+    n --;
+}
+
+void net::frame_ring::erase(size_t i) {
+    for(; i + 1 < n; i ++) (*this)[i] = (*this)[i + 1];
+    n --;
+}
+
+void net::frame_ring::pop_back(size_t count) {
+    n -= count;
 }
 
 net::socket::~socket() {
@@ -226,9 +1837,10 @@ size_t net::socket::operator>>(std::string& string) {
             // throw std::runtime_error("Recv failed");
         }
 
-        buf[s] = '\0';
-        
-        string += buf;
+        if(s == (size_t) -1 || s == 0) break;
+
+        // Binary frames contain '\0', so append by length.
+        string.append(buf, s);
 
         success = poll(&_pollfd, 1, 0);
         if(success == -1) {
@@ -392,4 +2004,4 @@ size_t clean_up_dead_sockets(std::vector<std::shared_ptr<net::socket>>& sockets,
     return i;
 }
 
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
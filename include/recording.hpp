@@ -0,0 +1,756 @@
+#ifndef RECORDING_H
+#define RECORDING_H
+/**
+ * @file recording.hpp
+ * @brief Flight recorder. Appends everything mission control sends and recieves to segment files on disk.
+ * @version 0.1
+ * @date 2023-09-30
+ *
+ * A recording is a directory of segments (segment-000000.mcr, segment-000001.mcr, ...). Each segment is:
+ *  - segment_header
+ *  - records: record_header, then the data, padded to 8 bytes. The first record is the latest advertisement,
+ *    and the first tick is a keyframe (unless the previous segment reached twice the segment size without one).
+ *  - footer: an index_entry for every tick record, then a segment_footer. Missing if the recorder didn't stop cleanly.
+ * All integers are little-endian.
+ */
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <optional>
+
+namespace recording {
+    /**
+     * @brief What a record holds.
+     *
+     */
+    enum kind : uint8_t {
+        advertise = 'A', // A binary advertisement frame.
+        tick = 'T', // A binary tick frame, including the tick's logs.
+        command = 'C' // Commands recieved from a client, ';' separated.
+    };
+
+    enum flags : uint8_t {
+        keyframe = 1
+    };
+
+    struct segment_header {
+        char magic[8]; // "MCREC002"
+        uint64_t number;
+    };
+
+    struct record_header {
+        uint32_t length; // Of the data, without padding. wrap in the recorder's ring means skip to the start.
+        uint8_t kind;
+        uint8_t flags;
+        uint16_t reserved;
+        int32_t client; // fd of the client that sent a command, -1 otherwise.
+        uint32_t padding;
+        int64_t time; // Microseconds since the epoch.
+    };
+
+    struct index_entry {
+        int64_t time;
+        uint64_t offset; // Of the record_header, from the start of the segment.
+    };
+
+    struct segment_footer {
+        uint64_t n_entries;
+        uint64_t index_offset;
+        uint64_t data_end;
+        char magic[8]; // "MCRIDX01"
+    };
+
+    static_assert(sizeof(segment_header) == 16 && sizeof(record_header) == 24 && sizeof(index_entry) == 16 && sizeof(segment_footer) == 32);
+
+    constexpr char segment_magic[8] = { 'M', 'C', 'R', 'E', 'C', '0', '0', '2' };
+    constexpr char footer_magic[8] = { 'M', 'C', 'R', 'I', 'D', 'X', '0', '1' };
+    constexpr uint32_t wrap = 0xffffffff;
+
+    inline size_t padded(size_t length) {
+        return (sizeof(record_header) + length + 7) & ~(size_t) 7;
+    }
+
+    inline int64_t now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    std::string segment_path(const std::string& directory, uint64_t number);
+
+    /**
+     * @brief Records are copied into a ring by the thread calling record(), and written out by a background
+     * thread with pwritev, so the caller never waits on the disk. If the disk falls so far behind that the
+     * ring fills, records are dropped and counted.
+     *
+     */
+    struct recorder {
+        std::string directory;
+        size_t segment_size;
+        std::chrono::milliseconds batch_interval;
+        std::chrono::milliseconds sync_interval;
+
+        /**
+         * @brief Records that didn't fit in the ring.
+         *
+         */
+        std::atomic<size_t> n_dropped = 0;
+        /**
+         * @brief Failed writes and syncs.
+         *
+         */
+        std::atomic<size_t> n_errors = 0;
+        /**
+         * @brief Set when the current segment is full. The next tick recorded should be a keyframe, and the next
+         * segment starts with it. Whoever records ticks clears it.
+         *
+         */
+        std::atomic<bool> want_keyframe = true;
+
+        /**
+         * @brief Start recording into directory (created if needed). Segments already in it are removed.
+         *
+         * @param directory
+         * @param segment_size Segments are preallocated to this many bytes. Once one fills up, a new one is started at
+         * the next keyframe, or regardless once it is twice this size.
+         * @param ring_size Bytes buffered between record() and the disk.
+         * @param batch_interval How often the background thread writes.
+         * @param sync_interval How often written data is fdatasync'd.
+         */
+        recorder(std::string directory, size_t segment_size = 64 << 20, size_t ring_size = 16 << 20,
+            std::chrono::milliseconds batch_interval = std::chrono::milliseconds(10),
+            std::chrono::milliseconds sync_interval = std::chrono::milliseconds(1000));
+        /**
+         * @brief Writes out everything recorded, finishes the last segment and stops the thread.
+         *
+         */
+        ~recorder();
+
+        /**
+         * @brief Queue a record. Only copies into the ring, never blocks.
+         *
+         * @param k
+         * @param data
+         * @param f flags
+         * @param client
+         * @return false if the ring was full and the record was dropped.
+         */
+        bool record(kind k, std::string_view data, uint8_t f = 0, int client = -1);
+
+        // Ring, written by record() and read by the thread.
+        std::vector<char> ring;
+        std::atomic<size_t> head = 0;
+        std::atomic<size_t> tail = 0;
+
+        std::atomic<bool> running = true;
+        std::thread thread;
+
+        // Only used by the thread.
+        int fd = -1;
+        uint64_t segment_number = 0;
+        size_t data_end = 0;
+        std::vector<index_entry> index;
+        std::string advertisement; // Latest advertisement record, copied to the start of every segment.
+        bool keyframe_requested = false; // Since the current segment filled up.
+        std::vector<iovec> iovecs;
+        size_t iovecs_bytes = 0;
+
+        void _run();
+        void _drain();
+        void _append(const char * record, size_t size);
+        void _write_pending();
+        void _open_segment();
+        void _finish_segment();
+    };
+
+    /**
+     * @brief A record in a mapped segment. data points into the mapping.
+     * 
+     */
+    struct record_view {
+        const record_header * header;
+        std::string_view data;
+    };
+
+    /**
+     * @brief One value out of a tick frame. bytes is the encoded value (see serialize::binary::write).
+     * 
+     */
+    struct value_view {
+        uint16_t id;
+        uint8_t tag;
+        std::string_view bytes;
+    };
+
+    /**
+     * @brief A readable listed in an advertisement.
+     * 
+     */
+    struct advertised {
+        uint16_t id;
+        uint8_t tag;
+        std::string name;
+    };
+
+    /**
+     * @brief Size of an encoded value with the given serialize::binary::tag.
+     * 
+     * @return 0 if it runs past end or the tag is unknown.
+     */
+    size_t value_size(uint8_t tag, const char * p, const char * end);
+
+    /**
+     * @brief Read a little-endian T from an unaligned pointer.
+     * 
+     */
+    template<typename T>
+    T _get(const char * p);
+
+    /**
+     * @brief Reads a recording in place: segments are mmapped, nothing is copied, and seeking uses the segment
+     * indexes. A segment without a footer (the recorder didn't stop cleanly) is indexed by scanning it once.
+     * 
+     */
+    struct reader {
+        struct segment {
+            const char * data = nullptr;
+            size_t size = 0;
+            size_t data_end = 0;
+            const index_entry * index = nullptr;
+            size_t n_entries = 0;
+            std::vector<index_entry> scanned_index;
+        };
+
+        /**
+         * @brief Where the next record is.
+         * 
+         */
+        struct position {
+            size_t segment = 0;
+            size_t offset = sizeof(segment_header);
+        };
+
+        std::vector<segment> segments;
+        /**
+         * @brief Readables in the latest advertisement. Ids only ever get added, so these hold for the whole recording.
+         * 
+         */
+        std::vector<advertised> readables;
+        std::vector<uint8_t> tags; // By id.
+
+        reader(const std::string& directory);
+        reader(const reader&) = delete;
+        ~reader();
+
+        position begin() const;
+        /**
+         * @brief Position of the first tick at or after time. O(log n).
+         * 
+         * @param time Microseconds since the epoch.
+         */
+        position seek(int64_t time) const;
+        /**
+         * @brief Position of the last keyframe at or before time, so that the ticks after it can be applied in order.
+         * 
+         * @param time Microseconds since the epoch.
+         */
+        position seek_keyframe(int64_t time) const;
+
+        /**
+         * @brief Get the record at p and move p past it.
+         * 
+         * @return false at the end of the recording.
+         */
+        bool next(position& p, record_view& record) const;
+        /**
+         * @brief Move to the next tick that has a value for id.
+         * 
+         * @return false at the end of the recording.
+         */
+        bool next(position& p, uint16_t id, record_view& record, value_view& value) const;
+
+        /**
+         * @brief Id of the readable called name.
+         * 
+         */
+        std::optional<uint16_t> id(std::string_view name) const;
+
+        /**
+         * @brief Call f(const value_view&) for every value in a tick record.
+         * 
+         * @return Offset in the frame just past the values (where the set values start), 0 if the frame is malformed.
+         */
+        template<typename F>
+        size_t for_each_value(const record_view& tick, F f) const;
+        /**
+         * @brief Find the value for id in a tick record.
+         * 
+         */
+        bool find(const record_view& tick, uint16_t id, value_view& value) const;
+
+        void _map(const std::string& path);
+        void _read_advertisement(std::string_view frame);
+        size_t _segment_at(int64_t time) const;
+        const index_entry * _index(const segment& s) const { return s.index != nullptr ? s.index : s.scanned_index.data(); }
+    };
+};
+
+template<typename T>
+T recording::_get(const char * p) {
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+size_t recording::value_size(uint8_t tag, const char * p, const char * end) {
+    size_t left = end - p;
+    switch(tag) {
+        case 'd': return left >= 8 ? 8 : 0;
+        case 'i': return left >= 4 ? 4 : 0;
+        case 's':
+        case 'j': return left >= 4 && left - 4 >= _get<uint32_t>(p) ? 4 + _get<uint32_t>(p) : 0;
+        case 'D': return left >= 4 && (left - 4) / 8 >= _get<uint32_t>(p) ? 4 + 8 * (size_t) _get<uint32_t>(p) : 0;
+        case 'I': return left >= 4 && (left - 4) / 4 >= _get<uint32_t>(p) ? 4 + 4 * (size_t) _get<uint32_t>(p) : 0;
+        case 'o': {
+            // u8 n_fields, then for each: u8 name length, name, u8 tag, value.
+            if(left < 1) return 0;
+            size_t n_fields = (uint8_t) p[0];
+            size_t size = 1;
+            for(size_t i = 0; i < n_fields; i ++) {
+                if(left - size < 1 || left - size - 1 < (uint8_t) p[size] + 1u) return 0;
+                size += 1 + (uint8_t) p[size];
+                uint8_t field_tag = p[size];
+                size_t n = value_size(field_tag, p + size + 1, end);
+                if(n == 0) return 0;
+                size += 1 + n;
+            }
+            return size;
+        }
+        case 'c': {
+            // u32 count, u8 tag, count i64 times, count values.
+            if(left < 5) return 0;
+            size_t count = _get<uint32_t>(p);
+            uint8_t element = p[4];
+            if((left - 5) / 8 < count) return 0;
+            size_t size = 5 + 8 * count;
+            for(size_t i = 0; i < count; i ++) {
+                size_t n = value_size(element, p + size, end);
+                if(n == 0) return 0;
+                size += n;
+            }
+            return size;
+        }
+    }
+    return 0;
+}
+
+std::string recording::segment_path(const std::string& directory, uint64_t number) {
+    char name[32];
+    snprintf(name, sizeof(name), "/segment-%06lu.mcr", (unsigned long) number);
+    return directory + name;
+}
+
+recording::recorder::recorder(std::string _directory, size_t _segment_size, size_t ring_size,
+    std::chrono::milliseconds _batch_interval, std::chrono::milliseconds _sync_interval)
+    : directory(_directory), segment_size(_segment_size), batch_interval(_batch_interval), sync_interval(_sync_interval), ring(ring_size) {
+    mkdir(directory.c_str(), 0755);
+    // Left over segments would read as the continuation of this recording.
+    for(uint64_t number = 0; unlink(segment_path(directory, number).c_str()) == 0; number ++);
+    _open_segment();
+    thread = std::thread(&recorder::_run, this);
+}
+
+recording::recorder::~recorder() {
+    running = false;
+    thread.join();
+}
+
+bool recording::recorder::record(kind k, std::string_view data, uint8_t f, int client) {
+    size_t need = padded(data.size());
+    if(need > ring.size() / 2) {
+        n_dropped ++;
+        return false;
+    }
+
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t offset = h % ring.size();
+    // Records are never split across the end of the ring, so the thread can write them straight out of it.
+    size_t skip = offset + need > ring.size() ? ring.size() - offset : 0;
+    if(h + skip + need - tail.load(std::memory_order_acquire) > ring.size()) {
+        n_dropped ++;
+        return false;
+    }
+    if(skip > 0) {
+        std::memcpy(&ring[offset], &wrap, sizeof(wrap));
+        h += skip;
+        offset = 0;
+    }
+
+    record_header header;
+    header.length = data.size();
+    header.kind = k;
+    header.flags = f;
+    header.reserved = 0;
+    header.client = client;
+    header.padding = 0;
+    header.time = now();
+    std::memcpy(&ring[offset], &header, sizeof(header));
+    std::memcpy(&ring[offset + sizeof(header)], data.data(), data.size());
+    head.store(h + need, std::memory_order_release);
+    return true;
+}
+
+void recording::recorder::_run() {
+    auto last_sync = std::chrono::steady_clock::now();
+    while(running.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_for(batch_interval);
+        _drain();
+        if(std::chrono::steady_clock::now() - last_sync >= sync_interval) {
+            if(fdatasync(fd) < 0) n_errors ++;
+            last_sync = std::chrono::steady_clock::now();
+        }
+    }
+    _drain();
+    _finish_segment();
+}
+
+void recording::recorder::_drain() {
+    size_t h = head.load(std::memory_order_acquire);
+    size_t t = tail.load(std::memory_order_relaxed);
+    while(t != h) {
+        size_t offset = t % ring.size();
+        uint32_t length;
+        std::memcpy(&length, &ring[offset], sizeof(length));
+        if(length == wrap) {
+            t += ring.size() - offset;
+            continue;
+        }
+        size_t size = padded(length);
+        _append(&ring[offset], size);
+        t += size;
+    }
+    _write_pending();
+    // The records are only written from the ring in _write_pending(), so only release them afterwards.
+    tail.store(t, std::memory_order_release);
+}
+
+void recording::recorder::_append(const char * record, size_t size) {
+    const record_header * header = reinterpret_cast<const record_header *>(record);
+
+    size_t end = data_end + iovecs_bytes + size;
+    bool full = end > segment_size && data_end + iovecs_bytes > sizeof(segment_header) + advertisement.size();
+    if(full && !keyframe_requested) {
+        want_keyframe.store(true, std::memory_order_relaxed);
+        keyframe_requested = true;
+    }
+    // Wait for a keyframe to start the next segment with, unless whoever is recording stopped sending them.
+    bool starts_segment = header->kind == tick && (header->flags & keyframe);
+    if(full && (starts_segment || end > 2 * segment_size)) {
+        _write_pending();
+        _finish_segment();
+        segment_number ++;
+        try {
+            _open_segment();
+        }catch(std::exception& e) {
+            // Keep going; the writes fail and are counted until a later segment opens.
+            n_errors ++;
+        }
+        // Ask again, for as early in this segment as possible.
+        if(!starts_segment) want_keyframe.store(true, std::memory_order_relaxed);
+    }
+    if(header->kind == advertise) advertisement.assign(record, size);
+
+    if(header->kind == tick) index.push_back({ header->time, data_end + iovecs_bytes });
+    iovecs.push_back({ const_cast<char *>(record), size });
+    iovecs_bytes += size;
+    if(iovecs.size() >= IOV_MAX) _write_pending();
+}
+
+void recording::recorder::_write_pending() {
+    size_t done = 0;
+    while(done < iovecs.size()) {
+        size_t n = std::min<size_t>(iovecs.size() - done, IOV_MAX);
+        ssize_t written = pwritev(fd, &iovecs[done], n, data_end);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            n_errors ++;
+            for(size_t i = done; i < done + n; i ++) data_end += iovecs[i].iov_len;
+            done += n;
+            continue;
+        }
+        // Short write: move past what made it and try the rest again.
+        data_end += written;
+        while(done < iovecs.size() && (size_t) written >= iovecs[done].iov_len) {
+            written -= iovecs[done].iov_len;
+            done ++;
+        }
+        if(written > 0) {
+            iovecs[done].iov_base = static_cast<char *>(iovecs[done].iov_base) + written;
+            iovecs[done].iov_len -= written;
+        }
+    }
+    iovecs.clear();
+    iovecs_bytes = 0;
+}
+
+void recording::recorder::_open_segment() {
+    std::string path = segment_path(directory, segment_number);
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        throw std::runtime_error("Couldn't open " + path);
+    }
+    // Allocate the whole segment up front so appends don't have to extend the file.
+    if(posix_fallocate(fd, 0, segment_size) != 0) n_errors ++;
+
+    segment_header header;
+    std::memcpy(header.magic, segment_magic, sizeof(header.magic));
+    header.number = segment_number;
+    if(pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) n_errors ++;
+    data_end = sizeof(header);
+    index.clear();
+    keyframe_requested = false;
+
+    if(!advertisement.empty()) {
+        iovecs.push_back({ advertisement.data(), advertisement.size() });
+        iovecs_bytes += advertisement.size();
+        _write_pending();
+    }
+}
+
+void recording::recorder::_finish_segment() {
+    if(fd < 0) return;
+    segment_footer footer;
+    footer.n_entries = index.size();
+    footer.index_offset = data_end;
+    footer.data_end = data_end;
+    std::memcpy(footer.magic, footer_magic, sizeof(footer.magic));
+
+    size_t index_bytes = index.size() * sizeof(index_entry);
+    if(pwrite(fd, index.data(), index_bytes, data_end) != (ssize_t) index_bytes) n_errors ++;
+    if(pwrite(fd, &footer, sizeof(footer), data_end + index_bytes) != sizeof(footer)) n_errors ++;
+    // Give back the preallocated space that wasn't used, so the footer is at the end of the file.
+    if(ftruncate(fd, data_end + index_bytes + sizeof(footer)) < 0) n_errors ++;
+    if(fdatasync(fd) < 0) n_errors ++;
+    close(fd);
+    fd = -1;
+}
+
+recording::reader::reader(const std::string& directory) {
+    for(uint64_t number = 0; ; number ++) {
+        std::string path = segment_path(directory, number);
+        if(access(path.c_str(), R_OK) != 0) break;
+        _map(path);
+    }
+    if(segments.empty()) {
+        throw std::runtime_error("No recording in " + directory);
+    }
+    // Advertisements only grow, so the last one names everything.
+    for(size_t i = segments.size(); i -- > 0 && readables.empty(); ) {
+        position p { i, sizeof(segment_header) };
+        record_view record;
+        while(p.segment == i && next(p, record)) {
+            if(record.header->kind == advertise) _read_advertisement(record.data);
+        }
+    }
+}
+
+recording::reader::~reader() {
+    for(segment& s : segments) munmap(const_cast<char *>(s.data), s.size);
+}
+
+void recording::reader::_map(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        throw std::runtime_error("Couldn't open " + path);
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(segment_header)) {
+        close(fd);
+        throw std::runtime_error("Not a recording segment: " + path);
+    }
+    void * mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mapped == MAP_FAILED) {
+        throw std::runtime_error("Couldn't map " + path);
+    }
+
+    segment s;
+    s.data = static_cast<const char *>(mapped);
+    s.size = st.st_size;
+    if(std::memcmp(s.data, segment_magic, sizeof(segment_magic)) != 0) {
+        munmap(mapped, s.size);
+        throw std::runtime_error("Not a recording segment: " + path);
+    }
+
+    segment_footer footer;
+    if(s.size >= sizeof(segment_header) + sizeof(footer)) std::memcpy(&footer, s.data + s.size - sizeof(footer), sizeof(footer));
+    if(s.size >= sizeof(segment_header) + sizeof(footer) && std::memcmp(footer.magic, footer_magic, sizeof(footer_magic)) == 0
+        && footer.data_end <= footer.index_offset && footer.index_offset + footer.n_entries * sizeof(index_entry) + sizeof(footer) <= s.size) {
+        s.data_end = footer.data_end;
+        s.index = reinterpret_cast<const index_entry *>(s.data + footer.index_offset);
+        s.n_entries = footer.n_entries;
+    }else {
+        // No footer. Walk the records until the preallocated zeros (or a torn record) start.
+        size_t offset = sizeof(segment_header);
+        while(offset + sizeof(record_header) <= s.size) {
+            record_header header;
+            std::memcpy(&header, s.data + offset, sizeof(header));
+            if((header.kind != advertise && header.kind != tick && header.kind != command) || padded(header.length) > s.size - offset) break;
+            if(header.kind == tick) s.scanned_index.push_back({ header.time, offset });
+            offset += padded(header.length);
+        }
+        s.data_end = offset;
+        s.n_entries = s.scanned_index.size();
+    }
+    // Reading goes front to back.
+    madvise(mapped, s.size, MADV_SEQUENTIAL);
+    segments.push_back(std::move(s));
+}
+
+void recording::reader::_read_advertisement(std::string_view frame) {
+    // u32 length, 'A', u16 n, n * (u16 id, u8 tag, u16 length, name)
+    readables.clear();
+    if(frame.size() < 7 || frame[4] != 'A') return;
+    const char * p = frame.data() + 7;
+    const char * end = frame.data() + frame.size();
+    size_t n = _get<uint16_t>(frame.data() + 5);
+    for(size_t i = 0; i < n && end - p >= 5; i ++) {
+        uint16_t length = _get<uint16_t>(p + 3);
+        if((size_t) (end - p - 5) < length) break;
+        readables.push_back({ _get<uint16_t>(p), (uint8_t) p[2], std::string(p + 5, length) });
+        p += 5 + length;
+    }
+    tags.clear();
+    for(const advertised& r : readables) {
+        if(r.id >= tags.size()) tags.resize(r.id + 1, 0);
+        tags[r.id] = r.tag;
+    }
+}
+
+recording::reader::position recording::reader::begin() const {
+    return position();
+}
+
+size_t recording::reader::_segment_at(int64_t time) const {
+    // Last segment that starts at or before time.
+    size_t first = 0, last = segments.size();
+    while(first + 1 < last) {
+        size_t middle = (first + last) / 2;
+        const segment& s = segments[middle];
+        if(s.n_entries > 0 && _index(s)[0].time <= time) first = middle;
+        else last = middle;
+    }
+    return first;
+}
+
+recording::reader::position recording::reader::seek(int64_t time) const {
+    for(size_t i = _segment_at(time); i < segments.size(); i ++) {
+        const segment& s = segments[i];
+        const index_entry * index = _index(s);
+        const index_entry * found = std::lower_bound(index, index + s.n_entries, time, [](const index_entry& e, int64_t t) {
+            return e.time < t;
+        });
+        if(found != index + s.n_entries) return { i, found->offset };
+    }
+    return { segments.size(), 0 };
+}
+
+recording::reader::position recording::reader::seek_keyframe(int64_t time) const {
+    size_t i = _segment_at(time);
+    const index_entry * index = _index(segments[i]);
+    // Ticks before entry are at or before time. Walk back from the last of them to a keyframe.
+    size_t entry = std::upper_bound(index, index + segments[i].n_entries, time, [](int64_t t, const index_entry& e) {
+        return t < e.time;
+    }) - index;
+    while(true) {
+        while(entry > 0) {
+            entry --;
+            const record_header * header = reinterpret_cast<const record_header *>(segments[i].data + index[entry].offset);
+            if(header->flags & keyframe) return { i, index[entry].offset };
+        }
+        if(i == 0) return begin();
+        i --;
+        index = _index(segments[i]);
+        entry = segments[i].n_entries;
+    }
+}
+
+bool recording::reader::next(position& p, record_view& record) const {
+    while(p.segment < segments.size()) {
+        const segment& s = segments[p.segment];
+        if(p.offset + sizeof(record_header) <= s.data_end) {
+            record.header = reinterpret_cast<const record_header *>(s.data + p.offset);
+            size_t size = padded(record.header->length);
+            if(size <= s.data_end - p.offset) {
+                record.data = std::string_view(s.data + p.offset + sizeof(record_header), record.header->length);
+                p.offset += size;
+                return true;
+            }
+        }
+        p.segment ++;
+        p.offset = sizeof(segment_header);
+    }
+    return false;
+}
+
+bool recording::reader::next(position& p, uint16_t id, record_view& record, value_view& value) const {
+    while(next(p, record)) {
+        if(record.header->kind == tick && find(record, id, value)) return true;
+    }
+    return false;
+}
+
+std::optional<uint16_t> recording::reader::id(std::string_view name) const {
+    for(const advertised& r : readables) {
+        if(r.name == name) return r.id;
+    }
+    return std::nullopt;
+}
+
+template<typename F>
+size_t recording::reader::for_each_value(const record_view& tick, F f) const {
+    // u32 length, 'T', u8 keyframe, u16 n, n * (u16 id, value)
+    if(tick.data.size() < 8 || tick.data[4] != 'T') return 0;
+    const char * p = tick.data.data() + 8;
+    const char * end = tick.data.data() + tick.data.size();
+    size_t n = _get<uint16_t>(tick.data.data() + 6);
+    for(size_t i = 0; i < n; i ++) {
+        if(end - p < 2) return 0;
+        value_view value;
+        value.id = _get<uint16_t>(p);
+        value.tag = value.id < tags.size() ? tags[value.id] : 0;
+        p += 2;
+        size_t size = value_size(value.tag, p, end);
+        if(size == 0) return 0;
+        value.bytes = std::string_view(p, size);
+        p += size;
+        f(value);
+    }
+    return p - tick.data.data();
+}
+
+bool recording::reader::find(const record_view& tick, uint16_t id, value_view& value) const {
+    bool found = false;
+    for_each_value(tick, [&](const value_view& v) {
+        if(v.id == id && !found) {
+            value = v;
+            found = true;
+        }
+    });
+    return found;
+}
+
+#endif
@@ -0,0 +1,368 @@
+/**
+ * @file bench.cpp
+ * @brief Micro-benchmarks for the hot paths. Run before a release and compare against the last run.
+ *
+ * missioncontrol_bench [filter]   Only runs benchmarks whose name contains filter.
+ *
+ * Every line is: name, ns/op, bytes/op (bytes produced, where that means something), allocs/op.
+ * Exits non-zero if tick() allocates, load() tears or an escaped string doesn't round trip, so it doubles as a check.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <missioncontrol.h>
+
+struct quaternion {
+    double w, x, y, z;
+};
+MISSION_CONTROL_FIELDS(quaternion, w, x, y, z)
+
+// Count every allocation, so that regressions that start allocating on the hot path show up.
+static std::atomic<size_t> n_allocations = 0;
+
+// These new and delete are a matching malloc/free pair, which gcc can't see once they are inlined.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void * operator new(size_t size) {
+    n_allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void * p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void * p) noexcept { std::free(p); }
+void operator delete(void * p, size_t) noexcept { std::free(p); }
+
+/**
+ * @brief Reaches into mission_control for the parts of a tick that aren't public.
+ *
+ */
+struct mission_control_bench {
+    static const std::string& build_msg(mission_control& control) {
+        control._collect_readables(true);
+        return control.build_msg(true);
+    }
+    static const std::string& build_binary_msg(mission_control& control) {
+        control._collect_readables(true);
+        return control.build_binary_msg(true);
+    }
+    static size_t parse(mission_control& control, std::string_view message, mission_control::command_call& call) {
+        return control._parse_next_command(message, call);
+    }
+};
+
+static const char * filter = nullptr;
+
+static void report(const char * name, double ns, double bytes, double allocs) {
+    printf("%-40s %12.1f ns/op %10.1f B/op %8.2f allocs/op\n", name, ns, bytes, allocs);
+    fflush(stdout);
+}
+
+/**
+ * @brief Run op until about 200ms have passed and report the per-op averages.
+ *
+ * @tparam F size_t() returning the bytes produced by one call.
+ * @param per_call Ops done by one call of op, to report e.g. per command when op parses a batch.
+ * @return Allocations per op, 0 if filtered out.
+ */
+template<typename F>
+static double bench(const char * name, F op, size_t per_call = 1) {
+    if(filter != nullptr && strstr(name, filter) == nullptr) return 0;
+
+    // Warm up, so buffers have grown to their steady size.
+    for(int i = 0; i < 16; i ++) op();
+
+    size_t n = 1;
+    while(true) {
+        size_t bytes = 0;
+        size_t allocations = n_allocations.load(std::memory_order_relaxed);
+        auto start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < n; i ++) bytes += op();
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        allocations = n_allocations.load(std::memory_order_relaxed) - allocations;
+        if(ns > 2e8 || n >= (1ul << 30)) {
+            double ops = (double) n * per_call;
+            report(name, ns / ops, bytes / ops, allocations / ops);
+            return allocations / ops;
+        }
+        n *= ns < 2e7 ? 10 : 2;
+    }
+}
+
+template<typename T>
+static void keep(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+static void bench_serialize() {
+    double d = 3.14159265358979;
+    int i = 123456;
+    std::string s = "a \"quoted\" string with\nescapes";
+    std::vector<double> v(100, 2.5);
+    quaternion q = { 0.7071, 0, 0.7071, 0 };
+
+    bench("serialize double", [&]() { std::string out = serialize::serialize(d); keep(out); return out.size(); });
+    bench("serialize int", [&]() { std::string out = serialize::serialize(i); keep(out); return out.size(); });
+    bench("serialize string", [&]() { std::string out = serialize::serialize(s); keep(out); return out.size(); });
+    bench("serialize vector<double>[100]", [&]() { std::string out = serialize::serialize(v); keep(out); return out.size(); });
+
+    std::string out;
+    bench("append double", [&]() { out.clear(); serialize::append(out, d); return out.size(); });
+    bench("append string", [&]() { out.clear(); serialize::append(out, s); return out.size(); });
+    bench("append vector<double>[100]", [&]() { out.clear(); serialize::append(out, v); return out.size(); });
+    bench("append described quaternion", [&]() { out.clear(); serialize::append(out, q); return out.size(); });
+    bench("binary write described quaternion", [&]() { out.clear(); serialize::binary::write(out, q); return out.size(); });
+}
+
+static void bench_build_msg() {
+    for(size_t n : { 10, 100, 1000, 10000 }) {
+        mission_control control;
+        std::vector<std::unique_ptr<readable<double>>> readables;
+        for(size_t i = 0; i < n; i ++) {
+            readables.push_back(std::make_unique<readable<double>>("readable_" + std::to_string(i), i * 0.5));
+            control.bind_readable(*readables.back());
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "build_msg %zu readables", n);
+        bench(name, [&]() { return mission_control_bench::build_msg(control).size(); });
+        snprintf(name, sizeof(name), "build_binary_msg %zu readables", n);
+        bench(name, [&]() { return mission_control_bench::build_binary_msg(control).size(); });
+    }
+}
+
+static void bench_parse() {
+    mission_control control;
+    std::string message;
+    size_t n_commands = 0;
+    for(int i = 0; i < 100; i ++) {
+        message += "set kx 0.5;custom a b \"c d\";format binary;";
+        n_commands += 3;
+    }
+
+    mission_control::command_call call;
+    bench("_parse_next_command", [&]() {
+        std::string_view remaining = message;
+        size_t parsed = 0;
+        while(true) {
+            size_t used = mission_control_bench::parse(control, remaining, call);
+            if(used == std::string_view::npos) break;
+            remaining.remove_prefix(used);
+            parsed ++;
+        }
+        keep(parsed);
+        return message.size();
+    }, n_commands);
+}
+
+/**
+ * @brief Check that a string with quotes and escapes in it survives serialize::append, the framer, the command
+ * tokenizer and deserialize<std::string>, and doesn't swallow the command after it.
+ *
+ */
+static void check_round_trip() {
+    std::string value = "a \"quoted\" \\ string; with\x01 escapes";
+    std::string sent = "custom ";
+    serialize::append(sent, value);
+    sent += ";next;";
+
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    send(pair[1], sent.data(), sent.size(), 0);
+    net::framer framer;
+    std::vector<std::string> commands;
+    framer.read(pair[0], [&](std::string_view command) { commands.emplace_back(command); });
+    close(pair[0]);
+    close(pair[1]);
+
+    mission_control control;
+    mission_control::command_call call;
+    bool ok = commands.size() == 2 && commands[1] == "next;";
+    if(ok) {
+        const std::string& command = commands[0];
+        ok = mission_control_bench::parse(control, command, call) == command.size() && call.args.size() == 1
+            && serialize::deserialize<std::string>(std::string(call.args[0])) == value;
+    }
+    if(!ok) {
+        fprintf(stderr, "A string with escapes didn't survive a round trip through a command\n");
+        exit(1);
+    }
+}
+
+static void bench_deserialize() {
+    for(size_t n : { 10, 1000 }) {
+        std::vector<double> v(n);
+        for(size_t i = 0; i < n; i ++) v[i] = i * 0.25;
+        std::string json = serialize::serialize(v);
+
+        char name[64];
+        snprintf(name, sizeof(name), "deserialize vector<double>[%zu]", n);
+        bench(name, [&]() { std::vector<double> out = serialize::deserialize<std::vector<double>>(json); keep(out); return json.size(); });
+    }
+}
+
+static void bench_broadcast() {
+    std::string message(512, 'x');
+    for(size_t n : { 1, 10, 100, 1000 }) {
+        char name[64];
+        snprintf(name, sizeof(name), "broadcast 512B to %zu clients", n);
+        if(filter != nullptr && strstr(name, filter) == nullptr) continue;
+
+        net::server server(-1);
+        std::vector<int> peers;
+        for(size_t i = 0; i < n; i ++) {
+            int pair[2];
+            if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+                perror("socketpair");
+                return;
+            }
+            server.add_client(pair[0]);
+            peers.push_back(pair[1]);
+        }
+
+        // Drain the peers after every broadcast, outside of the timed part, so no queue builds up.
+        char sink[1 << 16];
+        size_t ops = 0, allocations = 0;
+        double ns = 0;
+        while(ns < 2e8) {
+            size_t before = n_allocations.load(std::memory_order_relaxed);
+            auto start = std::chrono::steady_clock::now();
+            server.broadcast(message);
+            ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            allocations += n_allocations.load(std::memory_order_relaxed) - before;
+            ops ++;
+            for(int peer : peers) {
+                while(recv(peer, sink, sizeof(sink), MSG_DONTWAIT) > 0);
+            }
+            server.process_incoming();
+        }
+        report(name, ns / ops, (double) message.size() * n, (double) allocations / ops);
+        for(int peer : peers) close(peer);
+    }
+}
+
+static void check_tick(const char * name, const char * format) {
+    if(filter != nullptr && strstr(name, filter) == nullptr) return;
+    mission_control control;
+    std::vector<std::unique_ptr<readable<double>>> readables;
+    for(size_t i = 0; i < 100; i ++) {
+        readables.push_back(std::make_unique<readable<double>>("readable_" + std::to_string(i), i * 0.5));
+        control.bind_readable(*readables.back());
+    }
+
+    // Either a shared memory reader, or socket clients in the given format.
+    const char * path = "/tmp/missioncontrol_bench.sock";
+    std::unique_ptr<net::shm_reader> reader;
+    std::vector<int> peers;
+    if(format == nullptr) {
+        control.connect_shared_memory("/missioncontrol_bench");
+        reader = std::make_unique<net::shm_reader>("/missioncontrol_bench");
+    }else {
+        unlink(path);
+        control.connect(path);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+        std::string command = std::string("format ") + format + ";";
+        for(int i = 0; i < 10; i ++) {
+            int peer = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(peer < 0 || ::connect(peer, (sockaddr *) &address, sizeof(address)) < 0) {
+                perror("connect");
+                exit(1);
+            }
+            send(peer, command.data(), command.size(), 0);
+            peers.push_back(peer);
+        }
+    }
+
+    char sink[1 << 16];
+    double value = 0;
+    double allocations = bench(name, [&]() {
+        for(auto& r : readables) *r = value;
+        value += 1;
+        control.tick();
+        for(int peer : peers) {
+            while(recv(peer, sink, sizeof(sink), MSG_DONTWAIT) > 0);
+        }
+        return (size_t) 0;
+    });
+    for(int peer : peers) close(peer);
+    if(format != nullptr) unlink(path);
+
+    // Once its buffers have grown, a tick must not allocate. Fail the run rather than only report it.
+    if(allocations > 0) {
+        fprintf(stderr, "%s: tick() allocated %.2f times per call\n", name, allocations);
+        exit(1);
+    }
+}
+
+static void bench_tick() {
+    check_tick("tick 100 readables", nullptr);
+    check_tick("tick 100 readables to 10 json clients", "json");
+    check_tick("tick 100 readables to 10 binary clients", "binary");
+}
+
+static void bench_load() {
+    // Also a stress check: a writer thread stores quaternions whose fields are all equal, so a torn load() shows up.
+    if(filter != nullptr && strstr("load with a writer thread", filter) == nullptr
+        && strstr("capture sample with a writer thread", filter) == nullptr) return;
+    readable<quaternion> q("q", quaternion { 0, 0, 0, 0 });
+    std::atomic<bool> running = true;
+    std::thread writer([&]() {
+        for(double i = 1; running.load(std::memory_order_relaxed); i ++) q.store({ i, i, i, i });
+    });
+    size_t n_torn = 0;
+    bench("load with a writer thread", [&]() {
+        quaternion now = q.load();
+        if(now.x != now.w || now.y != now.w || now.z != now.w) n_torn ++;
+        return sizeof(now);
+    });
+
+    // capture::sample() goes through load() too.
+    capture<quaternion> samples(q, 1024);
+    bench("capture sample with a writer thread", [&]() {
+        samples.sample();
+        if(samples.head - samples.tail >= samples.values.size() / 2) {
+            samples.take();
+            for(size_t i = samples.sending_begin; i != samples.sending_end; i ++) {
+                const quaternion& now = samples.values[i % samples.values.size()];
+                if(now.x != now.w || now.y != now.w || now.z != now.w) n_torn ++;
+            }
+        }
+        return sizeof(quaternion);
+    });
+    running = false;
+    writer.join();
+    if(n_torn > 0) {
+        fprintf(stderr, "load() or sample() returned %zu torn values\n", n_torn);
+        exit(1);
+    }
+}
+
+int main(int argc, char ** argv) {
+    if(argc > 1) filter = argv[1];
+    signal(SIGPIPE, SIG_IGN);
+
+    check_round_trip();
+
+    bench_serialize();
+    bench_build_msg();
+    bench_parse();
+    bench_deserialize();
+    bench_broadcast();
+    bench_tick();
+    bench_load();
+    return 0;
+}
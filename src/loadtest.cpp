@@ -0,0 +1,274 @@
+/**
+ * @file loadtest.cpp
+ * @brief End to end load test: one mission_control ticking thousands of readables, and N dashboard clients
+ * connected through net::connect() that read every tick and send a stream of set and custom commands.
+ *
+ * missioncontrol_loadtest [options]
+ *   -c clients       Simulated dashboard clients (10).
+ *   -r readables     Bound readables (2000).
+ *   -t hz            Tick rate (100).
+ *   -d seconds       How long to measure, after one second of warm up (10).
+ *   -s per_second    set commands per second, spread over the clients (100).
+ *   -x per_second    Custom commands per second, spread over the clients (100).
+ *   -k n             Keyframe interval (0, every readable every tick).
+ *   -p port          Use tcp on 127.0.0.1:port instead of a unix socket.
+ *   -i               Do socket I/O on mission_control's I/O thread.
+ *   -u pattern       Subscribe every client to pattern (e.g. "value_1*") instead of every readable.
+ *
+ * Reports tick to receive latency percentiles, frames clients never got, and the CPU time spent in tick().
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <csignal>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+
+#include <missioncontrol.h>
+
+struct options {
+    int clients = 10;
+    int readables = 2000;
+    double hz = 100;
+    double seconds = 10;
+    double sets = 100;
+    double customs = 100;
+    unsigned int keyframe_interval = 0;
+    int port = 0;
+    bool io_thread = false;
+    const char * subscribe = nullptr;
+    const char * path = "/tmp/missioncontrol_loadtest.sock";
+};
+
+static std::atomic<bool> measuring = false;
+static std::atomic<bool> stopping = false;
+
+// Tick to receive latency of every frame every client got for the ticks in [first_tick, end_tick).
+static histogram latency;
+static std::atomic<int64_t> first_tick = INT64_MAX;
+static std::atomic<int64_t> end_tick = INT64_MAX;
+static std::atomic<size_t> n_frames = 0;
+static std::atomic<size_t> n_missed = 0; // Ticks a client never got a frame for.
+static std::atomic<size_t> n_bytes = 0;
+static std::atomic<size_t> n_sent_commands = 0;
+static std::atomic<size_t> n_client_errors = 0;
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double thread_cpu_ns() {
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+// Picks a number out of "name":value in a json tick, or returns false if it isn't there.
+static bool find_number(std::string_view message, std::string_view key, double& value) {
+    size_t at = message.find(key);
+    if(at == std::string_view::npos) return false;
+    const char * begin = message.data() + at + key.size();
+    auto [end, err] = std::from_chars(begin, message.data() + message.size(), value);
+    return err == std::errc();
+}
+
+/**
+ * @brief One dashboard: reads ticks as they come and sends commands at its share of the command rates.
+ *
+ */
+static void run_client(const options& o, int index) {
+    std::unique_ptr<net::socket> socket;
+    try {
+        socket = o.port != 0 ? net::connect("127.0.0.1", o.port) : net::connect(o.path);
+    }catch(std::exception& e) {
+        fprintf(stderr, "client %d: %s\n", index, e.what());
+        n_client_errors ++;
+        return;
+    }
+    if(o.subscribe != nullptr) *socket << std::string("subscribe __lt.* ") + o.subscribe + ";";
+
+    // Each client sends its share of the commands, offset so they don't all arrive on the same tick.
+    double set_interval = o.sets > 0 ? o.clients / o.sets * 1e9 : 0;
+    double custom_interval = o.customs > 0 ? o.clients / o.customs * 1e9 : 0;
+    double next_set = now_ns() + set_interval * index / o.clients;
+    double next_custom = now_ns() + custom_interval * index / o.clients;
+    unsigned long n_set = 0;
+
+    std::string received, pending;
+    double last_tick = -1;
+    while(!stopping) {
+        double now = now_ns();
+        std::string commands;
+        size_t n_commands = 0;
+        while(set_interval > 0 && now >= next_set) {
+            commands += "set setpoint " + std::to_string(n_set ++ % 1000) + ";";
+            next_set += set_interval;
+            n_commands ++;
+        }
+        while(custom_interval > 0 && now >= next_custom) {
+            commands += "noop a b \"c d\";";
+            next_custom += custom_interval;
+            n_commands ++;
+        }
+        if(!commands.empty()) {
+            *socket << commands;
+            if(measuring) n_sent_commands += n_commands;
+        }
+
+        pollfd p = { socket->fd, POLLIN, 0 };
+        if(poll(&p, 1, 1) <= 0) continue;
+        if(*socket >> received == 0) break; // Server went away.
+        pending += received;
+
+        // Messages are separated by \x1f. Keep the tail of a message that hasn't all arrived yet.
+        size_t start = 0;
+        while(true) {
+            size_t end = pending.find('\x1f', start);
+            if(end == std::string::npos) break;
+            std::string_view message(pending.data() + start, end - start);
+            start = end + 1;
+
+            double sent, tick;
+            if(!find_number(message, "\"__lt.sent_ns\":", sent) || !find_number(message, "\"__lt.tick\":", tick)) continue;
+            if(tick < 0) continue; // One of the ticks that only collect stats.
+            if(tick >= first_tick && tick < end_tick) {
+                latency.record((uint64_t) std::max(0.0, now_ns() - sent));
+                n_frames ++;
+                n_bytes += message.size();
+                if(last_tick >= 0 && tick > last_tick + 1) n_missed += tick - last_tick - 1;
+            }
+            last_tick = tick;
+        }
+        pending.erase(0, start);
+    }
+}
+
+static void usage(const char * name) {
+    fprintf(stderr, "usage: %s [-c clients] [-r readables] [-t hz] [-d seconds] [-s sets/s] [-x customs/s] [-k keyframe interval] [-p port] [-i] [-u pattern]\n", name);
+    exit(1);
+}
+
+int main(int argc, char ** argv) {
+    options o;
+    int opt;
+    while((opt = getopt(argc, argv, "c:r:t:d:s:x:k:p:iu:")) != -1) {
+        switch(opt) {
+            case 'c': o.clients = atoi(optarg); break;
+            case 'r': o.readables = atoi(optarg); break;
+            case 't': o.hz = atof(optarg); break;
+            case 'd': o.seconds = atof(optarg); break;
+            case 's': o.sets = atof(optarg); break;
+            case 'x': o.customs = atof(optarg); break;
+            case 'k': o.keyframe_interval = atoi(optarg); break;
+            case 'p': o.port = atoi(optarg); break;
+            case 'i': o.io_thread = true; break;
+            case 'u': o.subscribe = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(o.clients < 1 || o.readables < 1 || o.hz <= 0 || o.seconds <= 0) usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    mission_control control;
+    if(o.port != 0) {
+        control.connect((unsigned short) o.port);
+    }else {
+        unlink(o.path);
+        control.connect(o.path);
+    }
+    if(o.io_thread) control.start_io_thread();
+    control.set_keyframe_interval(o.keyframe_interval);
+    control.set_tick_rate(o.hz);
+
+    // The readables: a slowly changing value each, so with a keyframe interval only some are sent every tick.
+    std::vector<double> values(o.readables);
+    for(int i = 0; i < o.readables; i ++) control.bind_readable("value_" + std::to_string(i), values[i]);
+    double sent_ns = 0, tick = 0;
+    control.bind_readable("__lt.sent_ns", sent_ns);
+    control.bind_readable("__lt.tick", tick);
+
+    double setpoint = 0;
+    control.add_writable<double>("setpoint", setpoint, [](double& v) { return v; });
+    size_t n_custom = 0;
+    control.add_command("noop", [&n_custom](std::vector<std::string>) { n_custom ++; });
+
+    std::vector<std::thread> clients;
+    for(int i = 0; i < o.clients; i ++) clients.emplace_back(run_client, std::cref(o), i);
+
+    auto period = std::chrono::nanoseconds((int64_t) (1e9 / o.hz));
+    int64_t warm_up_ticks = (int64_t) o.hz;
+    int64_t n_ticks = warm_up_ticks + (int64_t) (o.hz * o.seconds);
+    double cpu_ns = 0;
+    size_t n_late = 0;
+    size_t dropped_before = 0;
+    size_t custom_before = 0;
+    mission_control::self_stats before;
+
+    auto next = std::chrono::steady_clock::now();
+    for(int64_t t = 0; t < n_ticks; t ++) {
+        if(t == warm_up_ticks) {
+            // Every client has connected and been sent a keyframe by now.
+            measuring = true;
+            first_tick = t;
+            end_tick = n_ticks;
+            tick = -1;
+            control.set_stats_interval(1);
+            control.tick();
+            before = control.stats();
+            control.set_stats_interval(0);
+            dropped_before = before.frames_dropped;
+            custom_before = n_custom;
+        }
+
+        for(int i = (t % 16); i < o.readables; i += 16) values[i] += 1;
+        tick = t;
+        sent_ns = now_ns();
+        double cpu = thread_cpu_ns();
+        control.tick();
+        if(measuring) cpu_ns += thread_cpu_ns() - cpu;
+
+        next += period;
+        if(std::chrono::steady_clock::now() > next) {
+            if(measuring) n_late ++;
+            next = std::chrono::steady_clock::now(); // Don't try to catch up with a burst.
+        }else {
+            std::this_thread::sleep_until(next);
+        }
+    }
+
+    // Let the last frames arrive before stopping the clients.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    measuring = false;
+    tick = -1;
+    control.set_stats_interval(1);
+    control.tick();
+    mission_control::self_stats after = control.stats();
+    stopping = true;
+    for(auto& c : clients) c.join();
+
+    int64_t measured = n_ticks - warm_up_ticks;
+    histogram::summary_t l = latency.summary();
+    printf("clients %d, readables %d, %.0f Hz for %.1f s over %s%s%s%s\n", o.clients, o.readables, o.hz, o.seconds,
+        o.port != 0 ? "tcp" : "unix", o.io_thread ? " with the I/O thread" : "",
+        o.subscribe != nullptr ? ", subscribed to " : "", o.subscribe != nullptr ? o.subscribe : "");
+    printf("latency us:        p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n", l.p50 / 1e3, l.p90 / 1e3, l.p99 / 1e3, l.max / 1e3);
+    printf("frames received:   %zu of %ld (%.1f MB/s per client)\n", n_frames.load(), measured * o.clients,
+        n_bytes / o.seconds / o.clients / 1e6);
+    printf("frames missed:     %zu by clients, %.0f dropped by the server\n", n_missed.load(), after.frames_dropped - dropped_before);
+    printf("cpu per tick:      %.1f us (%.1f%% of one core)\n", cpu_ns / measured / 1e3, cpu_ns / (o.seconds * 1e9) * 100);
+    printf("late ticks:        %zu\n", n_late);
+    printf("commands:          %zu sent, %.0f run, %.0f errors, %zu custom\n", n_sent_commands.load(), after.commands - before.commands,
+        after.command_errors - before.command_errors, n_custom - custom_before);
+    if(n_client_errors > 0) printf("clients failed:    %zu\n", n_client_errors.load());
+
+    if(o.port == 0) unlink(o.path);
+    return n_client_errors > 0 ? 1 : 0;
+}
@@ -4,14 +4,10 @@
 #include <iostream>
 
 #include <vector.h>
-namespace serialize {
-    std::string serialize(const math::vector& v) {
-        return "{\"x\":"+std::to_string(v.x)+",\"y\":"+std::to_string(v.y)+",\"z\":"+std::to_string(v.z)+"}";
-    }
-};
-
 #include <missioncontrol.h>
 
+MISSION_CONTROL_FIELDS(math::vector, x, y, z)
+
 
 int main() {
     mission_control control("/tmp/server.sock");